@@ -43,6 +43,10 @@ function main()
 	for k,v in pairs(ThreadData()) do
 		Send(string.format("%s = %s\n", k, v))
 	end
+	Send("</pre><h1>Pool</h1><pre>\n")
+	for k,v in pairs(PoolStats()) do
+		Send(string.format("%s = %s\n", k, v))
+	end
 	Send("</pre><h1>Config</h1><pre>\n")
 	DumpTable(Config or {}, "Config")
 	Send("</pre>")
@@ -85,5 +89,12 @@ function main()
 			-> Debug thread data information.
 			Returns a table in which the keys are script names,
 			 and the values are the number of loaded scripts.
+		
+		PoolStats()
+			-> Global Lua state pool statistics.
+			LoadedStates, LoadedMemory (KB), EvictedStates, EvictedPools,
+			 RebuiltPools (reloaded in the background after a change),
+			 ModuleCacheMemory (KB), MaxStates and MaxMemory (KB, 0 = no limit),
+			 ReservoirSize, ReservoirStates (ready now), ReservoirHits and ReservoirMisses.
 	]]
 end
@@ -1,4 +1,5 @@
 --[[ Configuration script for luafcgid2 ]]--
+-- Reloaded on SIGHUP, except for WorkerThreads, listen, LogFile, UseInotify, SessionShards and SessionStore.
 
 -- Amount of worker threads
 WorkerThreads = 4
@@ -6,12 +7,35 @@ WorkerThreads = 4
 -- Number of default Lua states initially loaded
 LuaStates = 1
 
--- Max number of Lua states (will be loaded as needed, but will never unload)
+-- Max number of Lua states per script (will be loaded as needed)
 LuaMaxStates = 6
 
+-- Max number of Lua states across all scripts. 0 means no limit.
+-- When exceeded, the least recently used idle states are unloaded (checked every second).
+LuaGlobalMaxStates = 0
+
+-- Max memory (in KB) used by all the Lua states together. 0 means no limit.
+-- When exceeded, the least recently used idle states are unloaded (checked every second).
+LuaGlobalMaxMemory = 0
+
 -- Max number of times to search for a free Lua state before creating a new ad-hoc one
 LuaMaxSearchRetries = 3
 
+-- Unload a script's Lua states after they have been idle for this many seconds. 0 means never.
+LuaStateIdleTime = 0
+
+-- Garbage collection after each request:
+-- "full" runs a full cycle, "step" a single incremental step, "auto" leaves it to Lua.
+LuaGCPolicy = "full"
+
+-- Per-script overrides of the settings above. The first rule whose Match glob
+-- matches the script's full path wins; fields left out use the global values.
+-- Rules are resolved once, when the script is first loaded.
+ScriptRules = {
+	-- { Match = "/var/www/api/*.lua", States = 4, MaxStates = 16, SearchRetries = 5 },
+	-- { Match = "/var/www/admin/*", States = 1, MaxStates = 1, GCPolicy = "auto", IdleTime = 300 },
+}
+
 -- Starting buffer size for custom HTTP headers
 HeadersSize = 128
 
@@ -23,14 +47,51 @@ BodySize = 2048
 BodySectors = 4
 
 -- Time (in ms) that we consider a file to be unchanged
--- It is suggested to increase this value as your server needs to manage more users and is under heavier load
--- Having more threads will kind of ignore this variable.
+-- A background thread checks every loaded script at most this often, once for all of its states.
 MinFileInfoTime = 5000
 
 -- Calculate a file's checksum to see if it changed
 -- It is only calculated at most every [MinFileInfoTime] ms
+-- Ignored when FileFingerprint is set.
 UseFileChecksum = true
 
+-- How a file is recognized as changed:
+-- "stat" compares device, inode, modification time and size (no reads at all),
+-- "hash" a fast 64-bit hash of the contents,
+-- "sha256" the SHA-256 digest of the contents.
+-- Leave empty to pick "sha256" or "stat" from UseFileChecksum.
+FileFingerprint = ""
+
+-- Lua modules loaded with require() are checked the same way as the scripts:
+-- when one of them changes, every state that may have loaded it is reloaded.
+
+-- Watch the loaded scripts with inotify (Linux only).
+-- Scripts are then only checked after the file system reports a change to them,
+-- and MinFileInfoTime only applies to the files that couldn't be watched.
+UseInotify = false
+
+-- Number of distinct script paths whose resolution is cached.
+-- Requests for paths beyond this limit are still served, just resolved every time.
+PathCacheSize = 4096
+
+-- KB of compiled Lua modules shared by all of the states.
+-- A module required by many scripts is then only compiled once per change.
+-- 0 to compile it in every state.
+ModuleCacheSize = 16384
+
+-- Number of missing script paths remembered, so that repeated requests
+-- for them are answered with a 404 without touching the file system,
+-- and for how long (ms). A file created meanwhile is only found once
+-- that time is up.
+-- 0 to look every time.
+MissingScriptCacheSize = 1024
+MissingScriptCacheTime = 5000
+
+-- Number of blank Lua states (libraries and Config loaded)
+-- kept ready in the background, so that a new state only has to run its script.
+-- 0 to create every state from scratch.
+StateReservoirSize = 4
+
 -- Sets the cookie name for the session key. Must be lower-case.
 SessionName = "XLuaSession"
 
@@ -41,6 +102,38 @@ SessionTime = 3600
 -- Length (in bytes) of the generated Session Keys
 SessionKeyLen = 24
 
+-- Number of independently locked parts of the session store.
+-- More shards let more threads look up sessions at once. Needs a restart to change.
+SessionShards = 16
+
+-- File keeping the sessions across restarts, restored before the first request.
+-- Leave empty to keep them in memory only. Needs a restart to change.
+SessionStore = ""
+
+-- How often the session changes are appended to SessionStore. In seconds.
+-- Also written on SIGTERM.
+SessionStoreInterval = 10
+
+-- Where the session data lives:
+-- "server" in this process, the cookie only carrying a random Session Key,
+-- "shared" in shared memory, seen by every luafcgid2 process of the host and
+-- surviving any of them crashing (switching to or from it needs a restart),
+-- "cookie" in the cookie itself, signed with HMAC-SHA256 and expiring after SessionTime.
+-- Cookie sessions need no server-side storage, so any process or host can serve them,
+-- but browsers only keep about 4 KB per cookie: larger sessions are not saved.
+SessionMode = "server"
+
+-- Key signing the "cookie" sessions. Use the same long random string on every host.
+-- When empty, a random key is picked at startup and the sessions end with the process.
+SessionSecret = ""
+
+-- SessionMode = "shared": name of the POSIX shared memory segment, the memory
+-- for the session data in KB and the number of sessions it can hold.
+-- The first process to start creates the segment, the others use it as it is.
+SharedSessionName = "/luafcgid2-sessions"
+SharedSessionMemory = 65536
+SharedSessionSlots = 65536
+
 -- Transmit the session cookie through HTTPS-only? (Sets the Secure attribute)
 SessionCookieSecure = true
 
@@ -89,6 +182,8 @@ StartupScript = ""
 entrypoint = "main"
 
 -- Config table, can be accessed from the scripts.
+-- Config[SERVER_NAME] is also available as LocalConfig.
+-- Both are copied once per Lua state: treat them as read-only.
 Config = {
 	entrypoint = entrypoint,
 	string_example = "Test config string",
@@ -0,0 +1,165 @@
+#include "csprng.h"
+#include "settings.h"
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace {
+	struct ChaCha {
+		enum { BLOCKS = 8, BUFFER = 64 * BLOCKS };
+		inline ChaCha() : m_counter(0), m_pos(BUFFER), m_seeded(false) {}
+		
+		std::uint32_t m_key[8];
+		std::uint64_t m_counter;
+		unsigned char m_buffer[BUFFER];
+		std::size_t m_pos; // Next unused byte of m_buffer
+		bool m_seeded;
+	};
+}
+static thread_local ChaCha t_chacha;
+
+static inline std::uint32_t Rotl(std::uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static inline void QuarterRound(std::uint32_t* x, int a, int b, int c, int d)
+{
+	x[a] += x[b]; x[d] = Rotl(x[d] ^ x[a], 16);
+	x[c] += x[d]; x[b] = Rotl(x[b] ^ x[c], 12);
+	x[a] += x[b]; x[d] = Rotl(x[d] ^ x[a], 8);
+	x[c] += x[d]; x[b] = Rotl(x[b] ^ x[c], 7);
+}
+
+void SecureRandom::Block(std::uint32_t const key[8], std::uint32_t const input[4], unsigned char out[64])
+{
+	std::uint32_t in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		input[0], input[1], input[2], input[3]
+	};
+	std::uint32_t x[16];
+	std::memcpy(x, in, sizeof(x));
+	for(int i = 0; i < 10; ++i)
+	{
+		QuarterRound(x, 0, 4, 8, 12);
+		QuarterRound(x, 1, 5, 9, 13);
+		QuarterRound(x, 2, 6, 10, 14);
+		QuarterRound(x, 3, 7, 11, 15);
+		QuarterRound(x, 0, 5, 10, 15);
+		QuarterRound(x, 1, 6, 11, 12);
+		QuarterRound(x, 2, 7, 8, 13);
+		QuarterRound(x, 3, 4, 9, 14);
+	}
+	for(int i = 0; i < 16; ++i)
+	{
+		std::uint32_t const v = x[i] + in[i];
+		out[4 * i] = static_cast<unsigned char>(v);
+		out[4 * i + 1] = static_cast<unsigned char>(v >> 8);
+		out[4 * i + 2] = static_cast<unsigned char>(v >> 16);
+		out[4 * i + 3] = static_cast<unsigned char>(v >> 24);
+	}
+}
+
+// getrandom, or /dev/urandom on kernels without it.
+static bool SystemEntropy(void* data, std::size_t size)
+{
+	unsigned char* p = static_cast<unsigned char*>(data);
+#ifdef SYS_getrandom
+	while(size > 0)
+	{
+		long n = syscall(SYS_getrandom, p, size, 0);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		p += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	if(size == 0)
+		return true;
+#endif
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return false;
+	while(size > 0)
+	{
+		ssize_t n = read(fd, p, size);
+		if(n <= 0)
+		{
+			if(n < 0 && errno == EINTR)
+				continue;
+			close(fd);
+			return false;
+		}
+		p += n;
+		size -= static_cast<std::size_t>(n);
+	}
+	close(fd);
+	return true;
+}
+
+static void Refill(ChaCha& c)
+{
+	if(!c.m_seeded)
+	{
+		if(!SystemEntropy(c.m_key, sizeof(c.m_key)))
+		{
+			// Session keys would be guessable: don't hand out any.
+			LogError("[RANDOM] No entropy source available!");
+			std::abort();
+		}
+		c.m_seeded = true;
+	}
+	// A 64-bit block counter and a zero nonce.
+	for(int i = 0; i < ChaCha::BLOCKS; ++i, ++c.m_counter)
+	{
+		std::uint32_t const input[4] = {
+			static_cast<std::uint32_t>(c.m_counter), static_cast<std::uint32_t>(c.m_counter >> 32), 0, 0
+		};
+		SecureRandom::Block(c.m_key, input, c.m_buffer + 64 * i);
+	}
+	
+	// The first 32 bytes become the next key and are never handed out.
+	std::memcpy(c.m_key, c.m_buffer, sizeof(c.m_key));
+	std::memset(c.m_buffer, 0, sizeof(c.m_key));
+	c.m_pos = sizeof(c.m_key);
+}
+
+void SecureRandom::Fill(void* data, std::size_t size)
+{
+	ChaCha& c = t_chacha;
+	unsigned char* p = static_cast<unsigned char*>(data);
+	while(size > 0)
+	{
+		if(c.m_pos == ChaCha::BUFFER)
+			Refill(c);
+		std::size_t n = ChaCha::BUFFER - c.m_pos;
+		if(n > size)
+			n = size;
+		std::memcpy(p, c.m_buffer + c.m_pos, n);
+		// Bytes handed out don't stay behind.
+		std::memset(c.m_buffer + c.m_pos, 0, n);
+		c.m_pos += n;
+		p += n;
+		size -= n;
+	}
+}
+
+unsigned SecureRandom::Below(unsigned bound)
+{
+	// Reject the top of the byte range that bound doesn't divide evenly.
+	unsigned const limit = 256 - 256 % bound;
+	for(;;)
+	{
+		unsigned char b;
+		Fill(&b, 1);
+		if(b < limit)
+			return b % bound;
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef CSPRNG_H_INCLUDED
+#define CSPRNG_H_INCLUDED
+#include <cstddef>
+#include <cstdint>
+
+// ChaCha20 keystream, one per thread, keyed from getrandom. Every refill
+// replaces the key with fresh output, so that earlier bytes can't be
+// recovered from the thread's state.
+class SecureRandom {
+	SecureRandom() =delete;
+public:
+	static void Fill(void* data, std::size_t size);
+	
+	// Uniform in [0, bound), bound <= 256.
+	static unsigned Below(unsigned bound);
+	
+	// The RFC 8439 block function. input is state words 12 to 15: the
+	// block counter and the nonce.
+	static void Block(std::uint32_t const key[8], std::uint32_t const input[4], unsigned char out[64]);
+};
+
+#endif
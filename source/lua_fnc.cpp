@@ -60,7 +60,7 @@ static void luaHeader(LuaRequestData* reqData, std::string const& key, Lua::Arg<
 
 static void luaPuts(LuaRequestData* reqData, std::string const& data)
 {
-	if(g_settings.m_bodysectors == 1 && !reqData->m_cache->body.empty())
+	if(g_settings->m_bodysectors == 1 && !reqData->m_cache->body.empty())
 	{
 		reqData->m_cache->body[0].append(data);
 		return;
@@ -85,8 +85,8 @@ static void luaPuts(LuaRequestData* reqData, std::string const& data)
 		}
 	}
 	reqData->m_cache->body.emplace_back();
-	if(static_cast<int>(data.size()) < g_settings.m_bodysize)
-		reqData->m_cache->body.back().reserve(g_settings.m_bodysize);
+	if(static_cast<int>(data.size()) < g_settings->m_bodysize)
+		reqData->m_cache->body.back().reserve(g_settings->m_bodysize);
 	reqData->m_cache->body.back().append(data);
 }
 
@@ -134,9 +134,16 @@ static Lua::Map<int> luaServerHealth(LuaRequestData*)
 	return d;
 }
 
+static Lua::Map<int> luaPoolStats(LuaRequestData*)
+{
+	Lua::Map<int> d;
+	d.m_data = g_statepool.PoolStats();
+	return d;
+}
+
 static std::string luaDir(LuaRequestData* reqData)
 {
-	return reqData->m_cache->script.dir();
+	return reqData->m_cache->script->dir();
 }
 
 static void luaSessionStart(LuaRequestData* reqData)
@@ -159,9 +166,10 @@ static void luaSessionClear(LuaRequestData* reqData, std::string const& realm)
 	reqData->m_session.Clear(realm);
 }
 
-static bool luaSessionSetVar(LuaRequestData* reqData, std::string const& realm, std::string const& var, std::shared_ptr<Lua::Variable> data)
+// data is encoded by the prelude's session codec, which wraps these two.
+static bool luaSessionSetVar(LuaRequestData* reqData, std::string const& realm, std::string const& var, Lua::Arg<std::string> const& data)
 {
-	return reqData->m_session.SetVar(realm, var, data.get());
+	return reqData->m_session.SetVar(realm, var, data ? &*data : nullptr);
 }
 
 static Lua::ReturnValues luaSessionGetVar(LuaRequestData* reqData, std::string const& realm, std::string const& var)
@@ -169,6 +177,161 @@ static Lua::ReturnValues luaSessionGetVar(LuaRequestData* reqData, std::string c
 	return reqData->m_session.GetVar(realm, var);
 }
 
+static Lua::ReturnValues luaSessionGetMany(LuaRequestData* reqData, std::string const& realm, std::string const& keys)
+{
+	return reqData->m_session.GetMany(realm, keys);
+}
+
+static bool luaSessionSetMany(LuaRequestData* reqData, std::string const& realm, std::string const& values)
+{
+	return reqData->m_session.SetMany(realm, values);
+}
+
+static Lua::ReturnValues luaSessionGetRealm(LuaRequestData* reqData, std::string const& realm)
+{
+	return reqData->m_session.GetRealm(realm);
+}
+
+// Bound to the lf functions, which need no context.
+struct LuaLibrary {};
+static LuaLibrary g_library;
+
+static int HexValue(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static std::string UrlDecode(char const* data, std::size_t len)
+{
+	std::string out;
+	out.reserve(len);
+	for(std::size_t i = 0; i < len; ++i)
+	{
+		if(data[i] == '+')
+			out += ' ';
+		else if(data[i] == '%' && i + 2 < len
+			&& HexValue(data[i+1]) >= 0 && HexValue(data[i+2]) >= 0)
+		{
+			out += static_cast<char>(HexValue(data[i+1]) * 16 + HexValue(data[i+2]));
+			i += 2;
+		}
+		else
+			out += data[i];
+	}
+	return out;
+}
+
+static Lua::ReturnValues lfUrlencode(LuaLibrary*, Lua::Arg<std::string> const& str)
+{
+	if(!str)
+		return Lua::Return();
+	static char const hex[] = "0123456789ABCDEF";
+	std::string out;
+	out.reserve(str->size() * 3);
+	for(auto it = str->begin(); it != str->end(); ++it)
+	{
+		unsigned char c = static_cast<unsigned char>(*it);
+		if((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+			out += static_cast<char>(c);
+		else if(c == ' ')
+			out += '+';
+		else
+		{
+			out += '%';
+			out += hex[c >> 4];
+			out += hex[c & 15];
+		}
+	}
+	return Lua::Return(out);
+}
+
+static Lua::ReturnValues lfUrldecode(LuaLibrary*, Lua::Arg<std::string> const& str)
+{
+	if(!str)
+		return Lua::Return();
+	return Lua::Return(UrlDecode(str->data(), str->size()));
+}
+
+// "key=value" -> key, value. The value stops at the next '='.
+static Lua::ReturnValues lfParsePair(LuaLibrary*, Lua::Arg<std::string> const& str)
+{
+	if(!str || str->empty())
+		return Lua::Return();
+	std::string::size_type eq = str->find('=');
+	if(eq == std::string::npos)
+		return Lua::Return(UrlDecode(str->data(), str->size()), std::string());
+	std::string::size_type end = str->find('=', eq + 1);
+	if(end == std::string::npos)
+		end = str->size();
+	return Lua::Return(
+		UrlDecode(str->data(), eq),
+		UrlDecode(str->data() + eq + 1, end - eq - 1));
+}
+
+static struct {
+	int m_code;
+	char const* m_status;
+} const g_responses[] = {
+	{100, "100 Continue"}, {101, "101 Switching Protocols"}, {102, "102 Processing"}, {103, "103 Early Hints"},
+	{200, "200 OK"}, {201, "201 Created"}, {202, "202 Accepted"}, {203, "203 Non-Authoritative Information"},
+	{204, "204 No Content"}, {205, "205 Reset Content"}, {206, "206 Partial Content"}, {207, "207 Multi-Status"},
+	{208, "208 Already Reported"}, {226, "226 IM Used"},
+	{300, "300 Multiple Choices"}, {301, "301 Moved Permanently"}, {302, "302 Found"}, {303, "303 See Other"},
+	{304, "304 Not Modified"}, {305, "305 Use Proxy"}, {306, "306 Switch Proxy"}, {307, "307 Temporary Redirect"},
+	{308, "308 Permanent Redirect"},
+	{400, "400 Bad Request"}, {401, "401 Unauthorized"}, {402, "402 Payment Required"}, {403, "403 Forbidden"},
+	{404, "404 Not Found"}, {405, "405 Method Not Allowed"}, {406, "406 Not Acceptable"},
+	{407, "407 Proxy Authentication Required"}, {408, "408 Request Timeout"}, {409, "409 Conflict"},
+	{410, "410 Gone"}, {411, "411 Length Required"}, {412, "412 Precondition Failed"},
+	{413, "413 Payload Too Large"}, {414, "414 URI Too Long"}, {415, "415 Unsupported Media Type"},
+	{416, "416 Range Not Satisfiable"}, {417, "417 Expectation Failed"}, {418, "418 I'm a teapot"},
+	{421, "421 Misdirected Request"}, {422, "422 Unprocessable Entity"}, {423, "423 Locked"},
+	{424, "424 Failed Dependency"}, {426, "426 Upgrade Required"}, {428, "428 Precondition Required"},
+	{429, "429 Too Many Requests"}, {431, "431 Request Header Fields Too Large"},
+	{451, "451 Unavailable For Legal Reasons"},
+	{500, "500 Internal Server Error"}, {501, "501 Not Implemented"}, {502, "502 Bad Gateway"},
+	{503, "503 Service Unavailable"}, {504, "504 Gateway Timeout"}, {505, "505 HTTP Version Not Supported"},
+	{506, "506 Variant Also Negotiates"}, {507, "507 Insufficient Storage"}, {508, "508 Loop Detected"},
+	{510, "510 Not Extended"}, {511, "511 Network Authentication Required"}
+};
+
+void SetupLuaLibrary(Lua::State& state)
+{
+	state.pushboolean(true);
+	state.setglobal("LUAFCGID");
+	state.pushinteger(2);
+	state.setglobal("LUAFCGID_VERSION");
+	
+	state.newtable();
+		state.pushstring("urlencode");
+		state.luapp_push_translated_function(Lua::Transform(::lfUrlencode, &g_library));
+		state.settable(-3);
+		
+		state.pushstring("urldecode");
+		state.luapp_push_translated_function(Lua::Transform(::lfUrldecode, &g_library));
+		state.settable(-3);
+		
+		state.pushstring("parse_pair");
+		state.luapp_push_translated_function(Lua::Transform(::lfParsePair, &g_library));
+		state.settable(-3);
+	state.setglobal("lf");
+	
+	state.newtable();
+	for(std::size_t i = 0; i < sizeof(g_responses) / sizeof(g_responses[0]); ++i)
+	{
+		state.pushinteger(g_responses[i].m_code);
+		state.pushstring(g_responses[i].m_status);
+		state.settable(-3);
+	}
+	state.setglobal("Response");
+}
+
 void SetupLuaFunctions(Lua::State& state, LuaRequestData& lrd)
 {
 	state.luapp_add_translated_function("Header", Lua::Transform(::luaHeader, &lrd));
@@ -179,6 +342,7 @@ void SetupLuaFunctions(Lua::State& state, LuaRequestData& lrd)
 	state.luapp_add_translated_function("RespStatus", Lua::Transform(::luaStatus, &lrd));
 	state.luapp_add_translated_function("RespContentType", Lua::Transform(::luaContentType, &lrd));
 	state.luapp_add_translated_function("ThreadData", Lua::Transform(::luaServerHealth, &lrd));
+	state.luapp_add_translated_function("PoolStats", Lua::Transform(::luaPoolStats, &lrd));
 	state.luapp_add_translated_function("Dir", Lua::Transform(::luaDir, &lrd));
 	
 	state.newtable();
@@ -205,5 +369,27 @@ void SetupLuaFunctions(Lua::State& state, LuaRequestData& lrd)
 		state.pushstring("GetVar");
 		state.luapp_push_translated_function(Lua::Transform(::luaSessionGetVar, &lrd));
 		state.settable(-3);
+		
+		state.pushstring("GetMany");
+		state.luapp_push_translated_function(Lua::Transform(::luaSessionGetMany, &lrd));
+		state.settable(-3);
+		
+		state.pushstring("SetMany");
+		state.luapp_push_translated_function(Lua::Transform(::luaSessionSetMany, &lrd));
+		state.settable(-3);
+		
+		state.pushstring("GetRealm");
+		state.luapp_push_translated_function(Lua::Transform(::luaSessionGetRealm, &lrd));
+		state.settable(-3);
+	
+	// Let the prelude wrap the value functions with the codec.
+	if(state.getglobal("__luafcgid_session") == Lua::TP_FUNCTION)
+	{
+		state.pushvalue(-2);
+		if(state.pcall(1, 0, 0) != 0)
+			state.pop(1);
+	}
+	else
+		state.pop(1);
 	state.setglobal("Session");
 }
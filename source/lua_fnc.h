@@ -10,5 +10,7 @@ struct LuaRequestData {
 };
 
 void rawLuaHeader(LuaRequestData* reqData, std::string const& key, std::string const& val);
+// lf helpers and Response table, once per state
+void SetupLuaLibrary(Lua::State& state);
 void SetupLuaFunctions(Lua::State& state, LuaRequestData& lrd);
 #endif
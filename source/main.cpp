@@ -17,27 +17,98 @@
 // nanosleep
 #include <time.h>
 
+// SIGHUP
+#include <csignal>
+#include <signal.h>
+#include <pthread.h>
+
 // Config
 #include "settings.h"
 #include "thread.h"
 #include "statepool.h"
 #include "monitor.h"
 #include "session.h"
+#include "sessionstore.h"
+#include "shmstore.h"
+#include "rcu.h"
+
+static volatile std::sig_atomic_t g_reloadRequested = 0;
+static volatile std::sig_atomic_t g_stopRequested = 0;
+
+static void OnSighup(int)
+{
+	g_reloadRequested = 1;
+}
+
+static void OnSigterm(int)
+{
+	g_stopRequested = 1;
+}
+
+// Re-evaluate the config file. Settings that shaped the process itself
+// (threads, socket, log, inotify) only change with a restart.
+static void ReloadSettings(std::string const& path)
+{
+	std::shared_ptr<Settings const> current = Settings::Current();
+	std::shared_ptr<Settings> settings = std::make_shared<Settings>();
+	if(!settings->LoadSettings(path))
+	{
+		LogError("[PARENT] Unable to reload luafcgid2 config, keeping the current one.");
+		return;
+	}
+	
+	if(settings->m_threadCount != current->m_threadCount
+		|| settings->m_listen != current->m_listen
+		|| settings->m_logFile != current->m_logFile
+		|| settings->m_useInotify != current->m_useInotify
+		|| settings->m_sessionShards != current->m_sessionShards
+		|| settings->m_sessionStore != current->m_sessionStore)
+		LogError("[PARENT] WorkerThreads, listen, LogFile, UseInotify, SessionShards and SessionStore need a restart to change.");
+	settings->m_threadCount = current->m_threadCount;
+	settings->m_listen = current->m_listen;
+	settings->m_logFile = current->m_logFile;
+	settings->m_useInotify = current->m_useInotify;
+	settings->m_sessionShards = current->m_sessionShards;
+	settings->m_sessionStore = current->m_sessionStore;
+	
+	// The shared memory segment is only opened at startup.
+	if((settings->m_sessionMode == SM_SHARED) != (current->m_sessionMode == SM_SHARED))
+	{
+		LogError("[PARENT] Switching SessionMode to or from \"shared\" needs a restart.");
+		settings->m_sessionMode = current->m_sessionMode;
+	}
+	
+	Settings::Publish(settings);
+	LogError("[PARENT] Config reloaded.");
+}
 
 int main(int argc, char** argv) {
 	std::unique_ptr<std::ofstream> logFile;
 	//pid_t pid = getpid();
 	
-	if( !g_settings.LoadSettings((argc > 1 && argv[1]) ? argv[1] : "config.lua") )
+	std::string const configPath = (argc > 1 && argv[1]) ? argv[1] : "config.lua";
 	{
-		std::cerr << "[PARENT] Unable to load luafcgid2 config!" << std::endl;
-		return 1;
+		std::shared_ptr<Settings> settings = std::make_shared<Settings>();
+		if( !settings->LoadSettings(configPath) )
+		{
+			std::cerr << "[PARENT] Unable to load luafcgid2 config!" << std::endl;
+			return 1;
+		}
+		Settings::Publish(settings);
 	}
+	
+	// SIGHUP and SIGTERM are only handled by this thread: every thread
+	// started from here on inherits the blocked mask.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
 	/* redirect stderr to logfile */
-	if(!g_settings.m_logFile.empty())
+	if(!g_settings->m_logFile.empty())
 	{
-		logFile.reset(new std::ofstream(g_settings.m_logFile, std::ios_base::out | std::ios_base::app));
+		logFile.reset(new std::ofstream(g_settings->m_logFile, std::ios_base::out | std::ios_base::app));
 		if(*logFile) {
 			std::cerr.rdbuf(logFile->rdbuf());
 		} else {
@@ -45,41 +116,81 @@ int main(int argc, char** argv) {
 		}
 	}
 	
-	if(!g_statepool.Start()) {
+	if(g_settings->m_sessionMode == SM_COOKIE && g_settings->m_sessionSecret.empty())
+		LogError("[PARENT] No SessionSecret: cookie sessions will only last as long as this process.");
+	
+	// One slot per worker thread, plus the pool's scanner.
+	Rcu::Setup(g_settings->m_threadCount + 1);
+	g_sessions.Setup(g_settings->m_sessionShards, !g_settings->m_sessionStore.empty());
+	if(!g_settings->m_sessionStore.empty())
+		SessionStore::Restore(g_settings->m_sessionStore);
+	if(g_settings->m_sessionMode == SM_SHARED
+		&& !SharedSessions::Open(g_settings->m_sharedSessionName, g_settings->m_sharedSessionMemory, g_settings->m_sharedSessionSlots))
+	{
+		std::cerr << "[PARENT] Unable to open the shared session store!" << std::endl;
+		return 1;
+	}
+	
+	if(!g_statepool.Start(g_settings->m_threadCount)) {
 		std::cerr << "[PARENT] Unable to startup lua states pool!" << std::endl;
 		return 1;
 	}
 	
 	FCGX_Init();
 
-	int sock = FCGX_OpenSocket(g_settings.m_listen.c_str(), -1);
+	int sock = FCGX_OpenSocket(g_settings->m_listen.c_str(), -1);
 	if (!sock) {
 		std::cerr << "[PARENT] Unable to create FCGI socket!" << std::endl;
 		return 1;
 	}
 	
 	std::vector<std::unique_ptr<Thread>> threads;
-	threads.reserve(g_settings.m_threadCount);
+	threads.reserve(g_settings->m_threadCount);
 	
-	for(int i = 0; i < g_settings.m_threadCount; ++i) {
+	for(int i = 0; i < g_settings->m_threadCount; ++i) {
 		threads.emplace_back(new Thread(i, sock));
 	}
 	
-	for(int i = 0; i < g_settings.m_threadCount; ++i) {
+	for(int i = 0; i < g_settings->m_threadCount; ++i) {
 		threads[i]->Spawn();
 	}
 	
+	SessionStore::Start();
+	
+	std::signal(SIGHUP, OnSighup);
+	std::signal(SIGTERM, OnSigterm);
+	pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+	
 	timespec tv;
 	tv.tv_sec = 1;
 	tv.tv_nsec = 0;
 	
-	for (int seconds=0;;) {
+	for (;;) {
 		nanosleep(&tv, NULL);
-		(++seconds) %= 60;
 		
-		// Every 60 seconds, clean up the sessions
-		if(seconds == 0)
-			g_sessions.CleanExpiredSessions();
+		if(g_stopRequested)
+		{
+			// Save the sessions, then die as before.
+			SessionStore::Flush();
+			std::signal(SIGTERM, SIG_DFL);
+			std::raise(SIGTERM);
+		}
+		if(g_reloadRequested)
+		{
+			g_reloadRequested = 0;
+			ReloadSettings(configPath);
+		}
+		SettingsScope ss;
+		
+		// Keep the Lua states within the global budget
+		g_statepool.EnforceBudget();
+		
+		// Free what the lock-free tables have unlinked
+		Rcu::Reclaim();
+		
+		// Drop the sessions that expired during the last second
+		g_sessions.ExpireSessions();
+		SharedSessions::Expire();
 	}
 
 	return 0;
@@ -0,0 +1,77 @@
+#include "modcache.h"
+#include "settings.h"
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <iterator>
+#include <limits>
+
+struct CachedModule {
+	inline CachedModule() : m_ticket(0) {}
+	
+	FileChangeData m_change;
+	int m_ticket; // 0 once compiled
+	std::shared_ptr<std::string const> m_bytecode;
+};
+
+static std::mutex g_modulesMutex;
+static std::map<std::string, CachedModule> g_modules;
+static int g_lastTicket = 0; // Positive, wraps after 2^31 compiles
+static std::size_t g_size = 0;
+
+int ModuleCache::Fetch(std::string const& path, FileChangeData const& fcd, std::string& data)
+{
+	std::shared_ptr<std::string const> bytecode;
+	int ticket = 0;
+	{
+		std::lock_guard<std::mutex> lg(g_modulesMutex);
+		CachedModule& mod = g_modules[path];
+		if(mod.m_bytecode && mod.m_change == fcd)
+			bytecode = mod.m_bytecode;
+		else
+		{
+			if(mod.m_bytecode)
+			{
+				g_size -= mod.m_bytecode->size();
+				mod.m_bytecode.reset();
+			}
+			mod.m_change = fcd;
+			if(g_lastTicket == std::numeric_limits<int>::max())
+				g_lastTicket = 0;
+			mod.m_ticket = ticket = ++g_lastTicket;
+		}
+	}
+	if(bytecode)
+	{
+		data = *bytecode;
+		return 0;
+	}
+	
+	std::ifstream file(path, std::ios_base::binary);
+	if(!file)
+		return -1;
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return ticket;
+}
+
+void ModuleCache::Store(std::string const& path, int ticket, std::string const& bytecode)
+{
+	std::size_t const limit = static_cast<std::size_t>(g_settings->m_moduleCacheSize) * 1024;
+	std::shared_ptr<std::string const> copy = std::make_shared<std::string const>(bytecode);
+	
+	std::lock_guard<std::mutex> lg(g_modulesMutex);
+	auto it = g_modules.find(path);
+	if(it == g_modules.end() || it->second.m_ticket != ticket)
+		return;
+	if(g_size + copy->size() > limit)
+		return; // Full: compiled by each state, like without the cache.
+	it->second.m_ticket = 0;
+	it->second.m_bytecode = copy;
+	g_size += copy->size();
+}
+
+std::size_t ModuleCache::Size()
+{
+	std::lock_guard<std::mutex> lg(g_modulesMutex);
+	return g_size;
+}
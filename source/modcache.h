@@ -0,0 +1,23 @@
+#ifndef MODCACHE_H_INCLUDED
+#define MODCACHE_H_INCLUDED
+#include "monitor.h"
+#include <string>
+#include <memory>
+
+// Process-wide cache of compiled require()d modules, keyed by path and fingerprint.
+// Sized by ModuleCacheSize.
+class ModuleCache {
+	ModuleCache() =delete;
+public:
+	// Fills data with the cached bytecode and returns 0, or with the source
+	// and returns the ticket to Store its bytecode with. Returns -1 when the
+	// file can't be read.
+	static int Fetch(std::string const& path, FileChangeData const& fcd, std::string& data);
+	
+	// Ignored when the file was fetched again since the ticket was issued.
+	static void Store(std::string const& path, int ticket, std::string const& bytecode);
+	
+	static std::size_t Size(); // Bytes
+};
+
+#endif
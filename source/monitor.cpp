@@ -1,5 +1,33 @@
 #include "monitor.h"
+#include "rcu.h"
+#include "spinlock_mutex.h"
 #include <picosha2.h>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <cerrno>
+
+struct InternedPath {
+	std::string m_script;
+	std::string m_root;
+	PathHandle m_path;
+};
+
+static RcuTable<InternedPath> g_interned;
+static std::mutex g_internMutex;
+
+static inline bool isDotSector(char const* s, std::string::size_type len)
+{
+	return (len == 1 && s[0] == '.')
+		|| (len == 2 && s[0] == '.' && s[1] == '.');
+}
 
 // Not a fully featured path simplifier, but it's just a safety measure.
 // Regular URLs will not be heavily impacted by this function.
@@ -10,11 +38,12 @@ SimplifiedPath FileMonitor::simplify(std::string const& src, std::string const&
 	std::string& dir = rval.m_dir;
 	rval.m_root = root;
 	dst.reserve(src.size());
-	dir.reserve(src.size()-6); // Shortest filename section: /x.lua
+	dir.reserve(src.size());
 	
 	std::string::size_type i = 0;
 	std::string::size_type len = src.size();
-	std::string sector;
+	std::string::size_type sectorBegin = 0;
+	std::string::size_type sectorLen = 0;
 	
 	while(i < len)
 	{
@@ -25,81 +54,543 @@ SimplifiedPath FileMonitor::simplify(std::string const& src, std::string const&
 		while(i < len && src[i] != '/' && src[i] != '\\')
 			++i;
 		
-		if(!sector.empty() && sector != ".." && sector != ".")
-			dir += "/" + sector;
+		if(sectorLen && !isDotSector(&src[sectorBegin], sectorLen))
+			dir.append(1, '/').append(src, sectorBegin, sectorLen);
 		
-		sector.assign(src, begin, i-begin);
+		sectorBegin = begin;
+		sectorLen = i - begin;
 		
-		if(sector == ".." || sector == ".")
+		if(isDotSector(&src[sectorBegin], sectorLen))
 			continue;
 		
 		dir = dst;
-		dst += "/" + sector;
+		dst.append(1, '/').append(src, sectorBegin, sectorLen);
 	}
 	
+	rval.m_hash = HashBytes(dst.data(), dst.size());
 	return rval;
 }
 
-FileChangeData FileMonitor::getFileStatus(std::ifstream& f)
+PathHandle FileMonitor::intern(char const* script, char const* root)
 {
-	FileChangeData fcd;
+	std::size_t const scriptLen = std::strlen(script);
+	std::size_t const rootLen = std::strlen(root);
+	std::size_t const hash = HashBytes(root, rootLen, HashBytes(script, scriptLen + 1));
 	
-	if(g_settings.m_useFileChecksum)
-	{
-		// std::ifstream f(path.m_path, std::ios_base::binary);
-		std::vector<std::uint8_t> s(picosha2::k_digest_size);
-		picosha2::hash256(f, s.begin(), s.end());
-		if(f)
-		{
-			std::swap(fcd.m_hash, s);
-			fcd.m_filesize = f.tellg();
-			fcd.m_exists = true;
+	auto Matches = [&](InternedPath const& p) -> bool {
+		return p.m_script.size() == scriptLen
+			&& p.m_root.size() == rootLen
+			&& std::memcmp(p.m_script.data(), script, scriptLen) == 0
+			&& std::memcmp(p.m_root.data(), root, rootLen) == 0;
+	};
+	
+	InternedPath* found = g_interned.find(hash, Matches);
+	if(found)
+		return found->m_path;
+	
+	PathHandle path = std::make_shared<SimplifiedPath>(simplify(script, root));
+	
+	std::lock_guard<std::mutex> lg(g_internMutex);
+	found = g_interned.find(hash, Matches);
+	if(found)
+		return found->m_path;
+	
+	// Past the limit (e.g. scanners requesting random paths) stop interning.
+	if(static_cast<int>(g_interned.size()) < g_settings->m_pathCacheSize)
+		g_interned.insert(hash, new InternedPath{script, root, path});
+	return path;
+}
+
+// xxHash64. Four independent lanes over 32-byte stripes, fed in pieces.
+static inline std::uint64_t ReadU64(std::uint8_t const* p)
+{
+	std::uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline std::uint64_t RotL(std::uint64_t v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static std::uint64_t const g_prime1 = 11400714785074694791ULL;
+static std::uint64_t const g_prime2 = 14029467366897019727ULL;
+static std::uint64_t const g_prime3 = 1609587929392839161ULL;
+static std::uint64_t const g_prime4 = 9650029242287828579ULL;
+static std::uint64_t const g_prime5 = 2870177450012600261ULL;
+
+static inline std::uint64_t HashRound(std::uint64_t acc, std::uint64_t input)
+{
+	return RotL(acc + input * g_prime2, 31) * g_prime1;
+}
+
+static inline std::uint64_t HashMerge(std::uint64_t acc, std::uint64_t lane)
+{
+	return (acc ^ HashRound(0, lane)) * g_prime1 + g_prime4;
+}
+
+namespace {
+	struct FastHash {
+		inline FastHash() : m_total(0), m_tailSize(0) {
+			m_v[0] = g_prime1 + g_prime2;
+			m_v[1] = g_prime2;
+			m_v[2] = 0;
+			m_v[3] = 0 - g_prime1;
 		}
+		
+		std::uint64_t m_v[4];
+		std::uint64_t m_total;
+		std::uint8_t m_tail[32]; // Start of an incomplete stripe
+		std::size_t m_tailSize;
+	};
+}
+
+static inline void HashStripe(FastHash& fh, std::uint8_t const* p)
+{
+	for(int lane = 0; lane < 4; ++lane)
+		fh.m_v[lane] = HashRound(fh.m_v[lane], ReadU64(p + lane * 8));
+}
+
+static void FastHashUpdate(FastHash& fh, std::uint8_t const* p, std::size_t len)
+{
+	std::uint8_t const* const end = p + len;
+	fh.m_total += len;
+	if(fh.m_tailSize + len < 32)
+	{
+		std::memcpy(fh.m_tail + fh.m_tailSize, p, len);
+		fh.m_tailSize += len;
+		return;
+	}
+	if(fh.m_tailSize)
+	{
+		std::size_t const fill = 32 - fh.m_tailSize;
+		std::memcpy(fh.m_tail + fh.m_tailSize, p, fill);
+		HashStripe(fh, fh.m_tail);
+		p += fill;
+		fh.m_tailSize = 0;
+	}
+	for(; p + 32 <= end; p += 32)
+		HashStripe(fh, p);
+	fh.m_tailSize = static_cast<std::size_t>(end - p);
+	std::memcpy(fh.m_tail, p, fh.m_tailSize);
+}
+
+static std::uint64_t FastHashFinal(FastHash const& fh)
+{
+	std::uint8_t const* p = fh.m_tail;
+	std::uint8_t const* const end = p + fh.m_tailSize;
+	std::uint64_t h;
+	
+	if(fh.m_total >= 32)
+	{
+		std::uint64_t const* v = fh.m_v;
+		h = RotL(v[0], 1) + RotL(v[1], 7) + RotL(v[2], 12) + RotL(v[3], 18);
+		for(int lane = 0; lane < 4; ++lane)
+			h = HashMerge(h, v[lane]);
 	}
 	else
+		h = g_prime5;
+	
+	h += fh.m_total;
+	for(; p + 8 <= end; p += 8)
+		h = RotL(h ^ HashRound(0, ReadU64(p)), 27) * g_prime1 + g_prime4;
+	if(p + 4 <= end)
+	{
+		std::uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		h = RotL(h ^ (v * g_prime1), 23) * g_prime2 + g_prime3;
+		p += 4;
+	}
+	for(; p < end; ++p)
+		h = RotL(h ^ (*p * g_prime5), 11) * g_prime1;
+	
+	h ^= h >> 33;
+	h *= g_prime2;
+	h ^= h >> 29;
+	h *= g_prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Hashes the contents through a fixed buffer. Not mmap: a file truncated
+// while being hashed (cp over it, an editor saving) would raise SIGBUS.
+static bool FingerprintContents(int fd, FileChangeData& fcd)
+{
+	bool const sha256 = g_settings->m_fingerprint == FP_SHA256;
+	picosha2::hash256_one_by_one sha;
+	FastHash fast;
+	std::uint8_t buffer[16384];
+	std::size_t size = 0;
+	for(;;)
 	{
-		//std::ifstream f(path.m_path, std::ios_base::binary | std::ios_base::ate);
-		f.seekg(0, std::ios_base::end);
-		if(f)
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if(n < 0)
 		{
-			fcd.m_filesize = f.tellg();
-			fcd.m_exists = true;
+			if(errno == EINTR)
+				continue;
+			return false;
 		}
+		if(n == 0)
+			break;
+		if(sha256)
+			sha.process(buffer, buffer + n);
+		else
+			FastHashUpdate(fast, buffer, static_cast<std::size_t>(n));
+		size += static_cast<std::size_t>(n);
 	}
 	
-	if(f)
+	// What was hashed, should the file have changed since the fstat.
+	fcd.m_filesize = size;
+	if(sha256)
 	{
-		f.seekg(0, std::ios_base::beg);
-		f.clear();
+		sha.finish();
+		sha.get_hash_bytes(fcd.m_hash.begin(), fcd.m_hash.end());
 	}
+	else
+	{
+		std::uint64_t h = FastHashFinal(fast);
+		std::memcpy(&fcd.m_hash[0], &h, sizeof(h));
+	}
+	return true;
+}
+
+FileChangeData FileMonitor::getFileStatus(std::string const& path)
+{
+	FileChangeData fcd;
 	fcd.m_captureTime = FileChangeData::clock_t::now();
+	
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return fcd;
+	
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return fcd;
+	}
+	
+	fcd.m_exists = true;
+	fcd.m_filesize = static_cast<std::size_t>(st.st_size);
+	
+	if(g_settings->m_fingerprint == FP_STAT)
+	{
+		fcd.m_device = static_cast<std::uint64_t>(st.st_dev);
+		fcd.m_inode = static_cast<std::uint64_t>(st.st_ino);
+		fcd.m_mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+	}
+	else
+	{
+		if(!FingerprintContents(fd, fcd))
+			fcd.m_exists = false;
+	}
+	
+	close(fd);
 	return fcd;
 }
 
+// Cheap freshness check: returns true with the new status in `current` when
+// the file changed since `storage` was captured, otherwise refreshes `storage`.
+static bool iCheckFile(std::string const& path, FileChangeData& storage,
+	FileWatch const* watch, FileChangeData& current)
+{
+	bool const watched = watch && watch->m_active.load(std::memory_order_acquire);
+	
+	// Read before touching the file: a change while we read it bumps it again.
+	unsigned const generation = watched ? watch->m_generation.load(std::memory_order_acquire) : 0;
+	if(watched)
+	{
+		if(generation == storage.m_generation)
+			return false;
+	}
+	else if(std::chrono::duration_cast<std::chrono::milliseconds>(FileChangeData::clock_t::now() - storage.m_captureTime).count()
+		<= g_settings->m_fileInfoTime)
+		return false;
+	
+	current = FileMonitor::getFileStatus(path);
+	current.m_generation = generation;
+	if(!current.m_exists)
+		return false;
+	if(current == storage)
+	{
+		// Unchanged: don't look again until the next interval or event.
+		storage.m_captureTime = current.m_captureTime;
+		storage.m_generation = generation;
+		return false;
+	}
+	return true;
+}
+
+bool FileMonitor::hasChanged(std::string const& path, FileChangeData& storage, FileWatch const* watch)
+{
+	FileChangeData current;
+	if(!iCheckFile(path, storage, watch, current))
+		return false;
+	storage = current;
+	return true;
+}
+
 std::unique_ptr<std::ifstream> FileMonitor::getFileForLoading(SimplifiedPath const& path,
-	FileChangeData& storage, bool forceReload)
+	FileChangeData& storage, bool forceReload, FileWatch const* watch)
 {
 	std::unique_ptr<std::ifstream> file;
 	FileChangeData compare;
 	if(forceReload)
 	{
-		file.reset(new std::ifstream(path.m_path, std::ios_base::binary));
-		compare = FileMonitor::getFileStatus(*file);
-		if(!*file)
+		bool const watched = watch && watch->m_active.load(std::memory_order_acquire);
+		unsigned const generation = watched ? watch->m_generation.load(std::memory_order_acquire) : 0;
+		compare = FileMonitor::getFileStatus(path.m_path);
+		compare.m_generation = generation;
+		if(!compare.m_exists)
 			return std::unique_ptr<std::ifstream>();
 	}
-	else
+	else if(!iCheckFile(path.m_path, storage, watch, compare))
+		return std::unique_ptr<std::ifstream>();
+	
+	file.reset(new std::ifstream(path.m_path, std::ios_base::binary));
+	if(!*file)
+		return std::unique_ptr<std::ifstream>();
+	storage = compare;
+	return file;
+}
+
+// Not watched: a request for any path would otherwise cost an inotify
+// watch on its directory for good. Only the TTL ends an entry.
+struct MissingFile {
+	std::string m_path;
+	FileChangeData::clock_t::time_point m_expires;
+};
+
+// Keyed by SimplifiedPath::hash(); a colliding path just isn't cached.
+static spinlock_mutex g_missingMutex;
+static std::unordered_map<std::size_t, MissingFile> g_missing;
+
+bool MissingFiles::Contains(SimplifiedPath const& path)
+{
+	if(g_settings->m_missingCacheSize == 0)
+		return false;
+	spinlock_guard lg(g_missingMutex);
+	auto it = g_missing.find(path.hash());
+	if(it == g_missing.end() || it->second.m_path != path.get())
+		return false;
+	MissingFile const& mf = it->second;
+	if(FileChangeData::clock_t::now() < mf.m_expires)
+		return true;
+	g_missing.erase(it);
+	return false;
+}
+
+void MissingFiles::Add(SimplifiedPath const& path)
+{
+	std::size_t const limit = static_cast<std::size_t>(g_settings->m_missingCacheSize);
+	if(limit == 0)
+		return;
+	
+	FileChangeData::clock_t::time_point const now = FileChangeData::clock_t::now();
+	MissingFile mf;
+	mf.m_path = path.get();
+	mf.m_expires = now + std::chrono::milliseconds(g_settings->m_missingCacheTime);
+	
+	spinlock_guard lg(g_missingMutex);
+	if(g_missing.size() >= limit && !g_missing.count(path.hash()))
 	{
-		if(std::chrono::duration_cast<std::chrono::milliseconds>(FileChangeData::clock_t::now() - storage.m_captureTime).count()
-			<= g_settings.m_fileInfoTime)
-			return std::unique_ptr<std::ifstream>();
+		for(auto it = g_missing.begin(); it != g_missing.end(); )
+		{
+			if(it->second.m_expires <= now)
+				it = g_missing.erase(it);
+			else
+				++it;
+		}
+		if(g_missing.size() >= limit)
+			g_missing.erase(g_missing.begin());
+	}
+	g_missing[path.hash()] = std::move(mf);
+}
+
+// Lock only guards the map: fingerprinting happens outside of it.
+FileChangeData FileDependencies::Add(std::string const& path)
+{
+	bool known;
+	{
+		std::lock_guard<std::mutex> lg(m_mutex);
+		known = m_files.count(path) != 0;
+	}
+	if(known)
+		return FileMonitor::getFileStatus(path);
+	
+	Entry entry;
+	std::string::size_type slash = path.rfind('/');
+	if(slash != std::string::npos)
+		entry.m_watch = FileWatcher::Watch(path, path.substr(0, slash));
+	unsigned const generation = entry.m_watch ? entry.m_watch->m_generation.load(std::memory_order_acquire) : 0;
+	entry.m_change = FileMonitor::getFileStatus(path);
+	entry.m_change.m_generation = generation;
+	
+	FileChangeData fcd = entry.m_change;
+	std::lock_guard<std::mutex> lg(m_mutex);
+	m_files.insert(std::make_pair(path, std::move(entry)));
+	return fcd;
+}
+
+bool FileDependencies::Changed()
+{
+	std::vector<std::pair<std::string, Entry>> files;
+	{
+		std::lock_guard<std::mutex> lg(m_mutex);
+		files.assign(m_files.begin(), m_files.end());
+	}
+	
+	bool changed = false;
+	for(auto it = files.begin(); !changed && it != files.end(); ++it)
+		changed = FileMonitor::hasChanged(it->first, it->second.m_change, it->second.m_watch.get());
+	
+	std::lock_guard<std::mutex> lg(m_mutex);
+	if(changed)
+	{
+		// The reloaded states record whatever they require now.
+		m_files.clear();
+		return true;
+	}
+	for(auto it = files.begin(); it != files.end(); ++it)
+	{
+		auto found = m_files.find(it->first);
+		if(found != m_files.end())
+			found->second.m_change = it->second.m_change;
+	}
+	return false;
+}
+
+struct WatchedDir {
+	std::string m_path;
+	std::map<std::string, std::weak_ptr<FileWatch>> m_files;
+};
+
+static int g_inotifyFd = -1;
+static std::mutex g_watchMutex;
+static std::map<int, WatchedDir> g_watchedDirs;
+static std::map<std::string, int> g_watchDescriptors;
+
+static void BumpDir(WatchedDir& dir, char const* name, bool lost)
+{
+	for(auto it = dir.m_files.begin(); it != dir.m_files.end(); )
+	{
+		std::shared_ptr<FileWatch> watch = it->second.lock();
+		if(!watch)
+		{
+			dir.m_files.erase(it++);
+			continue;
+		}
+		if(!name || it->first == name)
+		{
+			if(lost)
+				watch->m_active.store(false, std::memory_order_release);
+			watch->m_generation.fetch_add(1, std::memory_order_acq_rel);
+		}
+		++it;
+	}
+}
+
+static void RunWatcher()
+{
+	std::vector<char> buffer(64 * (sizeof(inotify_event) + NAME_MAX + 1));
+	while(true)
+	{
+		ssize_t len = read(g_inotifyFd, &buffer[0], buffer.size());
+		if(len <= 0)
+		{
+			if(len < 0 && errno == EINTR)
+				continue;
+			LogError("[FileWatcher] Unable to read inotify events, falling back to polling.");
+			break;
+		}
 		
-		file.reset(new std::ifstream(path.m_path, std::ios_base::binary));
-		compare = FileMonitor::getFileStatus(*file);
-		if( (!*file)
-			|| (compare == storage))
-			return std::unique_ptr<std::ifstream>();
+		std::lock_guard<std::mutex> lg(g_watchMutex);
+		for(ssize_t i = 0; i < len; )
+		{
+			inotify_event const* ev = reinterpret_cast<inotify_event const*>(&buffer[i]);
+			i += sizeof(inotify_event) + ev->len;
+			
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				// Events were dropped: consider everything changed.
+				for(auto it = g_watchedDirs.begin(); it != g_watchedDirs.end(); ++it)
+					BumpDir(it->second, nullptr, false);
+				continue;
+			}
+			
+			auto dir = g_watchedDirs.find(ev->wd);
+			if(dir == g_watchedDirs.end())
+				continue;
+			
+			if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+			{
+				// The directory itself is gone: its files go back to polling.
+				BumpDir(dir->second, nullptr, true);
+				g_watchDescriptors.erase(dir->second.m_path);
+				g_watchedDirs.erase(dir);
+				continue;
+			}
+			if(ev->len)
+				BumpDir(dir->second, ev->name, false);
+		}
 	}
-	storage = compare;
-	return file;
+	
+	std::lock_guard<std::mutex> lg(g_watchMutex);
+	for(auto it = g_watchedDirs.begin(); it != g_watchedDirs.end(); ++it)
+		BumpDir(it->second, nullptr, true);
+	g_watchedDirs.clear();
+	g_watchDescriptors.clear();
+	close(g_inotifyFd);
+	g_inotifyFd = -1;
+}
+
+bool FileWatcher::Start()
+{
+	if(!g_settings->m_useInotify)
+		return true;
+	
+	g_inotifyFd = inotify_init1(IN_CLOEXEC);
+	if(g_inotifyFd < 0)
+	{
+		LogError("[FileWatcher] inotify is not available, falling back to polling.");
+		return true;
+	}
+	std::thread(RunWatcher).detach();
+	return true;
+}
+
+std::shared_ptr<FileWatch> FileWatcher::Watch(std::string const& file, std::string const& dir)
+{
+	if(file.size() <= dir.size() + 1)
+		return std::shared_ptr<FileWatch>();
+	std::string name = file.substr(dir.size() + 1);
+	
+	std::lock_guard<std::mutex> lg(g_watchMutex);
+	if(g_inotifyFd < 0)
+		return std::shared_ptr<FileWatch>();
+	
+	int wd;
+	auto known = g_watchDescriptors.find(dir);
+	if(known != g_watchDescriptors.end())
+		wd = known->second;
+	else
+	{
+		wd = inotify_add_watch(g_inotifyFd, dir.empty() ? "/" : dir.c_str(),
+			IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE
+			| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		if(wd < 0)
+			return std::shared_ptr<FileWatch>();
+		g_watchDescriptors[dir] = wd;
+		g_watchedDirs[wd].m_path = dir;
+	}
+	
+	std::weak_ptr<FileWatch>& slot = g_watchedDirs[wd].m_files[name];
+	std::shared_ptr<FileWatch> watch = slot.lock();
+	if(!watch)
+	{
+		watch = std::make_shared<FileWatch>();
+		slot = watch;
+	}
+	return watch;
 }
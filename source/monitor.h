@@ -4,18 +4,27 @@
 #include <fstream>
 #include <memory>
 #include <atomic>
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <map>
+#include <mutex>
 
 class SimplifiedPath {
 	friend class FileMonitor;
 	std::string m_path;
 	std::string m_dir;
 	std::string m_root;
+	std::size_t m_hash;
 public:
 	// Const only
 	inline std::string const& get() const {
 		return m_path;
 	}
+	// HashBytes of get()
+	inline std::size_t hash() const {
+		return m_hash;
+	}
 	inline std::string const& dir() const {
 		return m_dir;
 	}
@@ -24,39 +33,107 @@ public:
 	}
 };
 
+// Interned, shared by every request for the same SCRIPT_FILENAME / DOCUMENT_ROOT.
+typedef std::shared_ptr<SimplifiedPath const> PathHandle;
+
 struct FileChangeData {
 	typedef std::chrono::steady_clock clock_t;
+	typedef std::array<std::uint8_t, 32> hash_t;
 	inline FileChangeData()
-		: m_exists(false), m_filesize(0) {}
+		: m_exists(false), m_hash(), m_filesize(0),
+		  m_device(0), m_inode(0), m_mtime(0), m_generation(0) {}
 
 	inline bool operator == (FileChangeData const& o) const {
 		return
 			m_exists == o.m_exists &&
 			m_filesize == o.m_filesize &&
-			m_hash == o.m_hash;
+			m_hash == o.m_hash &&
+			m_device == o.m_device &&
+			m_inode == o.m_inode &&
+			m_mtime == o.m_mtime;
 	}
 	inline bool operator != (FileChangeData const& o) const {
 		return !(*this == o);
 	}
 
 	bool m_exists;
-	std::vector<std::uint8_t> m_hash;
+	hash_t m_hash; // FP_SHA256: digest, FP_HASH: 64-bit hash, FP_STAT: zeroes
 	std::size_t m_filesize;
+	
+	// FP_STAT only
+	std::uint64_t m_device;
+	std::uint64_t m_inode;
+	std::int64_t m_mtime; // ns
 
 	clock_t::time_point m_captureTime;
+	unsigned m_generation; // FileWatch::m_generation at capture time
+};
+
+// Change counter of a single file, bumped by the FileWatcher thread.
+struct FileWatch {
+	// Starts ahead of FileChangeData, so that whatever was captured before
+	// the watch existed gets checked once.
+	inline FileWatch() : m_generation(1), m_active(true) {}
+
+	std::atomic<unsigned> m_generation;
+	std::atomic<bool> m_active; // Cleared when the watch is lost; poll instead.
+};
+
+// Optional inotify thread (UseInotify) watching the directory of every loaded script.
+class FileWatcher {
+	FileWatcher() =delete;
+public:
+	static bool Start();
+	
+	// Returns nullptr when disabled or when the directory can't be watched.
+	static std::shared_ptr<FileWatch> Watch(std::string const& file, std::string const& dir);
 };
 
 class FileMonitor {
-	static FileChangeData getFileStatus(std::ifstream&);
 	FileMonitor() =delete;
 public:
+	// Fingerprint a file as configured by FileFingerprint.
+	static FileChangeData getFileStatus(std::string const& path);
+	
 	static SimplifiedPath simplify(std::string const&, std::string const&);
+	
+	// Cached simplify(). Must run inside an RcuSection.
+	static PathHandle intern(char const* script, char const* root);
 
+	// Freshness check honoring MinFileInfoTime / the FileWatch. Updates storage when changed.
+	static bool hasChanged(std::string const& path, FileChangeData& storage, FileWatch const* watch =nullptr);
+	
+	// With an active FileWatch, freshness checks don't touch the file system.
 	static std::unique_ptr<std::ifstream>
 		getFileForLoading(
 			SimplifiedPath const&,
 			FileChangeData&,
-			bool =false);
+			bool =false,
+			FileWatch const* =nullptr);
+};
+
+// Scripts recently found missing (MissingScriptCacheSize / MissingScriptCacheTime).
+class MissingFiles {
+	MissingFiles() =delete;
+public:
+	static bool Contains(SimplifiedPath const&);
+	static void Add(SimplifiedPath const&);
+};
+
+// Files loaded by a pool's states through require(), fingerprinted when first seen.
+class FileDependencies {
+	struct Entry {
+		FileChangeData m_change;
+		std::shared_ptr<FileWatch> m_watch; // Null when not watched
+	};
+	std::mutex m_mutex;
+	std::map<std::string, Entry> m_files;
+public:
+	// Returns the current fingerprint of the file.
+	FileChangeData Add(std::string const& path);
+	
+	// Scanner only. Once a dependency changed, forgets all of them.
+	bool Changed();
 };
 
 #endif
@@ -0,0 +1,71 @@
+#include "rcu.h"
+#include <mutex>
+#include <limits>
+
+struct Retired {
+	std::uint64_t m_epoch;
+	std::function<void()> m_fn;
+};
+
+// Epoch 0 means "not inside a section".
+static std::atomic<std::uint64_t> g_epoch(1);
+static std::unique_ptr<std::atomic<std::uint64_t>[]> g_threads;
+static int g_threadCount = 0;
+
+static std::mutex g_retiredMutex;
+static std::vector<Retired> g_retired;
+
+void Rcu::Setup(int threads)
+{
+	g_threads.reset(new std::atomic<std::uint64_t>[threads]);
+	for(int i = 0; i < threads; ++i)
+		g_threads[i].store(0);
+	g_threadCount = threads;
+}
+
+void Rcu::Enter(int tid)
+{
+	g_threads[tid].store(g_epoch.load(), std::memory_order_seq_cst);
+}
+
+void Rcu::Leave(int tid)
+{
+	g_threads[tid].store(0, std::memory_order_release);
+}
+
+void Rcu::Retire(std::function<void()> fn)
+{
+	std::uint64_t epoch = g_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+	std::lock_guard<std::mutex> lg(g_retiredMutex);
+	g_retired.push_back(Retired{epoch, std::move(fn)});
+}
+
+void Rcu::Reclaim()
+{
+	std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+	for(int i = 0; i < g_threadCount; ++i)
+	{
+		std::uint64_t e = g_threads[i].load(std::memory_order_seq_cst);
+		if(e != 0 && e < oldest)
+			oldest = e;
+	}
+
+	std::vector<Retired> ready;
+	{
+		std::lock_guard<std::mutex> lg(g_retiredMutex);
+		for(auto it = g_retired.begin(); it != g_retired.end(); )
+		{
+			// Threads that entered at or after the retire epoch can't see it.
+			if(it->m_epoch <= oldest)
+			{
+				ready.push_back(std::move(*it));
+				it = g_retired.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+
+	for(auto it = ready.begin(); it != ready.end(); ++it)
+		it->m_fn();
+}
@@ -0,0 +1,188 @@
+#ifndef RCU_H_INCLUDED
+#define RCU_H_INCLUDED
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+// Quiescent-state based reclamation.
+// Worker threads call Enter before touching a lock-free structure and Leave
+// once the request is over. Memory unlinked by a writer is handed to Retire
+// and only released by Reclaim after every thread has left the section
+// during which it could have seen it.
+class Rcu {
+	Rcu() =delete;
+public:
+	static void Setup(int threads);
+	static void Enter(int tid);
+	static void Leave(int tid);
+	static void Retire(std::function<void()> fn);
+	static void Reclaim();
+};
+
+class RcuSection {
+	int const m_tid;
+	RcuSection(RcuSection const&) =delete;
+	RcuSection& operator= (RcuSection const&) =delete;
+public:
+	inline explicit RcuSection(int tid) : m_tid(tid) { Rcu::Enter(m_tid); }
+	inline ~RcuSection() { Rcu::Leave(m_tid); }
+};
+
+// FNV-1a, used to key the lock-free tables without building std::strings.
+inline std::size_t HashBytes(char const* data, std::size_t len, std::size_t seed = 14695981039346656037ULL)
+{
+	std::uint64_t h = seed;
+	for(std::size_t i = 0; i < len; ++i)
+	{
+		h ^= static_cast<unsigned char>(data[i]);
+		h *= 1099511628211ULL;
+	}
+	return static_cast<std::size_t>(h);
+}
+
+// Open-addressing hash table of T* with lock-free, allocation-free lookups.
+// Writers must be serialized by the caller. Lookups are only valid inside
+// an RcuSection; the values themselves must be retired through Rcu too.
+template <typename T>
+class RcuTable {
+	struct Entry {
+		std::atomic<std::size_t> m_hash;
+		std::atomic<T*> m_value;
+	};
+	struct Table {
+		explicit Table(std::size_t size) : m_mask(size - 1), m_used(0), m_entries(new Entry[size]) {
+			for(std::size_t i = 0; i < size; ++i)
+			{
+				m_entries[i].m_hash.store(0, std::memory_order_relaxed);
+				m_entries[i].m_value.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+		std::size_t const m_mask;
+		std::size_t m_used; // Live entries and tombstones, writer only
+		std::unique_ptr<Entry[]> m_entries;
+	};
+
+	std::atomic<Table*> m_table;
+	std::size_t m_count;
+
+	static T* tombstone() {
+		return reinterpret_cast<T*>(static_cast<std::uintptr_t>(1));
+	}
+
+	static void iInsert(Table& table, std::size_t hash, T* value) {
+		for(std::size_t i = hash & table.m_mask;; i = (i + 1) & table.m_mask)
+		{
+			T* v = table.m_entries[i].m_value.load(std::memory_order_relaxed);
+			if(v == nullptr || v == tombstone())
+			{
+				if(v == nullptr)
+					++table.m_used;
+				table.m_entries[i].m_hash.store(hash, std::memory_order_relaxed);
+				table.m_entries[i].m_value.store(value, std::memory_order_release);
+				return;
+			}
+		}
+	}
+
+	void iGrow() {
+		Table* old = m_table.load(std::memory_order_relaxed);
+		std::size_t size = 16;
+		while(size < (m_count + 1) * 4)
+			size *= 2;
+
+		Table* table = new Table(size);
+		for(std::size_t i = 0; i <= old->m_mask; ++i)
+		{
+			T* v = old->m_entries[i].m_value.load(std::memory_order_relaxed);
+			if(v != nullptr && v != tombstone())
+				iInsert(*table, old->m_entries[i].m_hash.load(std::memory_order_relaxed), v);
+		}
+		m_table.store(table, std::memory_order_seq_cst);
+		Rcu::Retire([old]() { delete old; });
+	}
+
+	RcuTable(RcuTable const&) =delete;
+	RcuTable& operator= (RcuTable const&) =delete;
+public:
+	inline RcuTable() : m_table(new Table(16)), m_count(0) {}
+	inline ~RcuTable() { delete m_table.load(); }
+
+	template <typename Pred>
+	T* find(std::size_t hash, Pred const& pred) const {
+		Table const* table = m_table.load(std::memory_order_acquire);
+		for(std::size_t i = hash & table->m_mask;; i = (i + 1) & table->m_mask)
+		{
+			T* v = table->m_entries[i].m_value.load(std::memory_order_acquire);
+			if(v == nullptr)
+				return nullptr;
+			if(v != tombstone()
+				&& table->m_entries[i].m_hash.load(std::memory_order_relaxed) == hash
+				&& pred(*v))
+				return v;
+		}
+	}
+
+	// Visits every value. Safe for readers inside an RcuSection.
+	template <typename Fn>
+	void for_each(Fn const& fn) const {
+		Table const* table = m_table.load(std::memory_order_acquire);
+		for(std::size_t i = 0; i <= table->m_mask; ++i)
+		{
+			T* v = table->m_entries[i].m_value.load(std::memory_order_acquire);
+			if(v != nullptr && v != tombstone())
+				fn(*v);
+		}
+	}
+
+	// Writer only.
+	void insert(std::size_t hash, T* value) {
+		Table* table = m_table.load(std::memory_order_relaxed);
+		if((table->m_used + 1) * 2 > table->m_mask + 1)
+			iGrow();
+		iInsert(*m_table.load(std::memory_order_relaxed), hash, value);
+		++m_count;
+	}
+
+	// Writer only. The caller retires the value.
+	bool erase(std::size_t hash, T* value) {
+		Table* table = m_table.load(std::memory_order_relaxed);
+		for(std::size_t i = hash & table->m_mask;; i = (i + 1) & table->m_mask)
+		{
+			T* v = table->m_entries[i].m_value.load(std::memory_order_relaxed);
+			if(v == nullptr)
+				return false;
+			if(v == value)
+			{
+				table->m_entries[i].m_value.store(tombstone(), std::memory_order_release);
+				--m_count;
+				return true;
+			}
+		}
+	}
+
+	// Writer only. Swaps value for replacement in place, so that lookups
+	// never miss. The caller retires value.
+	bool replace(std::size_t hash, T* value, T* replacement) {
+		Table* table = m_table.load(std::memory_order_relaxed);
+		for(std::size_t i = hash & table->m_mask;; i = (i + 1) & table->m_mask)
+		{
+			T* v = table->m_entries[i].m_value.load(std::memory_order_relaxed);
+			if(v == nullptr)
+				return false;
+			if(v == value)
+			{
+				table->m_entries[i].m_value.store(replacement, std::memory_order_release);
+				return true;
+			}
+		}
+	}
+
+	std::size_t size() const {
+		return m_count;
+	}
+};
+
+#endif
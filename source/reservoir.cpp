@@ -0,0 +1,163 @@
+#include "reservoir.h"
+#include "settings.h"
+#include "modcache.h"
+#include "lua_fnc.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+struct Reservoir {
+	std::mutex m_mutex;
+	std::condition_variable m_cv; // Signaled when a state is taken
+	std::vector<Lua::State> m_states;
+	int m_generation; // Settings::m_configGeneration of m_states
+	std::atomic<int> m_hits;
+	std::atomic<int> m_misses;
+};
+
+static Reservoir g_reservoir;
+static thread_local FileDependencies* t_deps = nullptr;
+
+DependencyScope::DependencyScope(FileDependencies* deps) : m_previous(t_deps)
+{
+	t_deps = deps;
+}
+
+DependencyScope::~DependencyScope()
+{
+	t_deps = m_previous;
+}
+
+// Called by the package.searchers entry of the prelude: returns the module's
+// cached bytecode, or its source and the ticket to hand back its bytecode with.
+static Lua::ReturnValues luaRequireHook(Reservoir*, std::string const& path)
+{
+	std::string data;
+	int ticket = ModuleCache::Fetch(path,
+		t_deps ? t_deps->Add(path) : FileMonitor::getFileStatus(path), data);
+	if(ticket < 0)
+		return Lua::Return();
+	return Lua::Return(data, ticket);
+}
+
+static void luaModuleCompiled(Reservoir*, std::string const& path, int ticket, std::string const& bytecode)
+{
+	ModuleCache::Store(path, ticket, bytecode);
+}
+
+// Bytecode compiled by LoadSettings
+static bool RunChunk(Lua::State& state, std::string const& bytecode, char const* error)
+{
+	if(state.loadbuffer(bytecode.c_str(), bytecode.size(), "head") != 0
+		|| state.pcall() != 0)
+	{
+		if(state.isstring(-1))
+			LogError(state.tostdstring(-1));
+		else
+			LogError(error);
+		
+		state.close();
+		return false;
+	}
+	return true;
+}
+
+// Everything InitState does before the script's own package.path. The
+// StartupScript runs after it, so that it can require the site's modules.
+static bool PrepareState(Lua::State& state)
+{
+	state = Lua::State::create();
+	state.openlibs();
+	
+	state.luapp_register_metatables();
+	state.luapp_add_translated_function("__luafcgid_require", Lua::Transform(::luaRequireHook, &g_reservoir));
+	state.luapp_add_translated_function("__luafcgid_compiled", Lua::Transform(::luaModuleCompiled, &g_reservoir));
+	
+	g_settings->TransferConfig(state);
+	SetupLuaLibrary(state);
+	
+	return RunChunk(state, g_settings->m_luaPrelude, "Error running the prelude.");
+}
+
+// Wakes up when a state is taken, or every second to follow reloads.
+static void RunReservoir()
+{
+	while(true)
+	{
+		SettingsScope ss;
+		std::size_t const size = static_cast<std::size_t>(g_settings->m_reservoirSize);
+		int const generation = g_settings->m_configGeneration;
+		{
+			std::unique_lock<std::mutex> lk(g_reservoir.m_mutex);
+			if(g_reservoir.m_generation != generation)
+			{
+				// Prepared with the previous configuration.
+				for(auto it = g_reservoir.m_states.begin(); it != g_reservoir.m_states.end(); ++it)
+					it->close();
+				g_reservoir.m_states.clear();
+				g_reservoir.m_generation = generation;
+			}
+			if(g_reservoir.m_states.size() >= size)
+			{
+				g_reservoir.m_cv.wait_for(lk, std::chrono::seconds(1));
+				continue;
+			}
+		}
+		
+		Lua::State state;
+		if(!PrepareState(state))
+		{
+			// Broken prelude: requests report it, don't spin on it.
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			continue;
+		}
+		
+		std::lock_guard<std::mutex> lg(g_reservoir.m_mutex);
+		if(g_reservoir.m_generation == generation)
+			g_reservoir.m_states.push_back(std::move(state));
+		else
+			state.close();
+	}
+}
+
+void StateReservoir::Start()
+{
+	g_reservoir.m_hits = 0;
+	g_reservoir.m_misses = 0;
+	g_reservoir.m_generation = 0;
+	std::thread(RunReservoir).detach();
+}
+
+bool StateReservoir::Acquire(Lua::State& state)
+{
+	{
+		std::lock_guard<std::mutex> lg(g_reservoir.m_mutex);
+		if(!g_reservoir.m_states.empty()
+			&& g_reservoir.m_generation == g_settings->m_configGeneration)
+		{
+			state = std::move(g_reservoir.m_states.back());
+			g_reservoir.m_states.pop_back();
+			g_reservoir.m_cv.notify_one();
+			++g_reservoir.m_hits;
+			return true;
+		}
+	}
+	++g_reservoir.m_misses;
+	return PrepareState(state);
+}
+
+std::map<std::string, int> StateReservoir::Stats()
+{
+	std::map<std::string, int> data;
+	{
+		std::lock_guard<std::mutex> lg(g_reservoir.m_mutex);
+		data["ReservoirStates"] = static_cast<int>(g_reservoir.m_states.size());
+	}
+	data["ReservoirSize"] = g_settings->m_reservoirSize;
+	data["ReservoirHits"] = g_reservoir.m_hits.load();
+	data["ReservoirMisses"] = g_reservoir.m_misses.load();
+	return data;
+}
@@ -0,0 +1,32 @@
+#ifndef RESERVOIR_H_INCLUDED
+#define RESERVOIR_H_INCLUDED
+#include "state.h"
+#include "monitor.h"
+#include <map>
+#include <string>
+
+// Stock of Lua states that went through the first steps of InitState
+// (libraries, metatables, Config and prelude), refilled in the background
+// up to StateReservoirSize.
+class StateReservoir {
+	StateReservoir() =delete;
+public:
+	static void Start();
+	
+	// Takes a prepared state, or prepares one on the spot. False on error.
+	static bool Acquire(Lua::State& state);
+	
+	static std::map<std::string, int> Stats();
+};
+
+// Modules required on this thread while it is alive are recorded in deps.
+class DependencyScope {
+	FileDependencies* const m_previous;
+	DependencyScope(DependencyScope const&) =delete;
+	DependencyScope& operator= (DependencyScope const&) =delete;
+public:
+	explicit DependencyScope(FileDependencies* deps);
+	~DependencyScope();
+};
+
+#endif
@@ -1,9 +1,19 @@
 #include "session.h"
 #include "settings.h"
+#include "rcu.h"
+#include "csprng.h"
+#include "signedcookie.h"
+#include "shmstore.h"
 #include <mutex>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
 
 Session::Session(SessionManager*, std::string session, SessionDetectData const& sdd) :
+	m_garbage(0),
+	m_expiration(expiration_clock::to_time_t(expiration_clock::now()) + g_settings->m_sessionTime),
+	m_dirty(true),
+	m_loggedExpiration(0),
 	m_sessionKey(std::move(session)), m_sds(sdd) {}
 
 Session::RealmIterator Session::GetRealms(std::string const& realm,
@@ -32,7 +42,7 @@ static inline std::time_t GetCurrentTimeT()
 
 void Session::Touch()
 {
-	m_expiration = GetCurrentTimeT() + g_settings.m_sessionTime;
+	m_expiration = GetCurrentTimeT() + g_settings->m_sessionTime;
 }
 
 bool Session::IsValid()
@@ -63,10 +73,19 @@ void Session::Clear(std::string const& realm)
 	std::size_t c = 0;
 	for(auto it = realms.begin(); it != realms.end(); ++it, ++c)
 	{
+		for(auto itv = it->second.begin(); itv != it->second.end(); ++itv)
+			ReleaseValue(itv->second);
 		it->second.clear();
 	}
 	if(c == m_realms.size())
+	{
 		m_realms.clear();
+		m_arena.clear();
+		m_garbage = 0;
+	}
+	else
+		CompactArena();
+	m_dirty.store(true, std::memory_order_relaxed);
 }
 
 void Session::Delete()
@@ -74,53 +93,265 @@ void Session::Delete()
 	m_expiration = 0;
 }
 
-bool Session::SetVar(std::string const& realm, std::string const& key, Lua::Variable* var)
+// Checks one value in the format of the prelude's session codec:
+// 1/2 false/true, 3/4 int32/int64, 5 double, 6/7 string with a 1/4-byte
+// length, 8 table (key/value pairs up to a 0). Little endian.
+static bool ValidValue(char const*& p, char const* end, int depth)
 {
-	Touch();
+	if(p == end)
+		return false;
+	std::size_t size = 0;
+	switch(*p++)
+	{
+	case 1:
+	case 2:
+		return true;
+	case 3:
+		size = 4;
+		break;
+	case 4:
+	case 5:
+		size = 8;
+		break;
+	case 6:
+		if(p == end)
+			return false;
+		size = static_cast<unsigned char>(*p++);
+		break;
+	case 7:
+		if(end - p < 4)
+			return false;
+		for(int i = 3; i >= 0; --i)
+			size = (size << 8) | static_cast<unsigned char>(p[i]);
+		p += 4;
+		break;
+	case 8:
+		if(depth >= 32)
+			return false;
+		while(p != end && *p != 0)
+		{
+			if(!ValidValue(p, end, depth + 1) || !ValidValue(p, end, depth + 1))
+				return false;
+		}
+		if(p == end)
+			return false;
+		++p;
+		return true;
+	default:
+		return false;
+	}
+	if(static_cast<std::size_t>(end - p) < size)
+		return false;
+	p += size;
+	return true;
+}
 
-	Lua::Bool* boolVar = nullptr;
-	Lua::Number* numVar = nullptr;
-	Lua::String* strVar = nullptr;
+static bool ValidValue(std::string const& data)
+{
+	char const* p = data.data();
+	char const* const end = p + data.size();
+	return ValidValue(p, end, 0) && p == end;
+}
 
-	Lua::ReturnValues vals;
-	bool has_vals = false;
-	
-	if(!var) {}
-	else if(var->IsBool(boolVar))
+static void EncodeString(std::string& out, std::string const& s)
+{
+	if(s.size() < 256)
+	{
+		out += '\x06';
+		out += static_cast<char>(s.size());
+	}
+	else
 	{
-		vals = Lua::Return(boolVar->cget());
-		has_vals = true;
+		out += '\x07';
+		for(int i = 0; i < 4; ++i)
+			out += static_cast<char>((s.size() >> (8 * i)) & 0xFF);
 	}
-	else if(var->IsNumber(numVar))
+	out += s;
+}
+
+// Reads an encoded string at p, already checked by ValidValue.
+static bool DecodeString(char const*& p, std::string& s)
+{
+	std::size_t size = 0;
+	if(*p == '\x06')
+	{
+		size = static_cast<unsigned char>(p[1]);
+		p += 2;
+	}
+	else if(*p == '\x07')
+	{
+		for(int i = 4; i >= 1; --i)
+			size = (size << 8) | static_cast<unsigned char>(p[i]);
+		p += 5;
+	}
+	else
+		return false;
+	s.assign(p, size);
+	p += size;
+	return true;
+}
+
+void Session::StoreValue(Value& value, std::string const& data)
+{
+	value.m_size = static_cast<std::uint32_t>(data.size());
+	if(data.size() <= Value::INLINE_SIZE)
+		std::memcpy(value.m_inline, data.data(), data.size());
+	else
 	{
-		vals = Lua::Return(numVar->cget());
-		has_vals = true;
+		value.m_offset = static_cast<std::uint32_t>(m_arena.size());
+		m_arena.append(data);
 	}
-	else if(var->IsString(strVar))
+}
+
+void Session::ReleaseValue(Value const& value)
+{
+	if(value.m_size > Value::INLINE_SIZE)
+		m_garbage += value.m_size;
+}
+
+char const* Session::ValueData(Value const& value) const
+{
+	if(value.m_size <= Value::INLINE_SIZE)
+		return value.m_inline;
+	return m_arena.data() + value.m_offset;
+}
+
+// Once half of the arena is garbage, move the live values to a new one.
+void Session::CompactArena()
+{
+	if(m_garbage < 4096 || m_garbage * 2 < m_arena.size())
+		return;
+	std::string arena;
+	arena.reserve(m_arena.size() - m_garbage);
+	for(auto it = m_realms.begin(); it != m_realms.end(); ++it)
 	{
-		vals = Lua::Return(strVar->cget());
-		has_vals = true;
+		for(auto itv = it->second.begin(); itv != it->second.end(); ++itv)
+		{
+			Value& value = itv->second;
+			if(value.m_size <= Value::INLINE_SIZE)
+				continue;
+			std::uint32_t offset = static_cast<std::uint32_t>(arena.size());
+			arena.append(m_arena, value.m_offset, value.m_size);
+			value.m_offset = offset;
+		}
 	}
+	m_arena.swap(arena);
+	m_garbage = 0;
+}
+
+bool Session::SetVar(std::string const& realm, std::string const& key, std::string const* data)
+{
+	Touch();
+	
+	if(data && !ValidValue(*data))
+		return false;
 
 	std::lock_guard<rw_mutex> mx(m_mutex);
 	Session::RealmIterator realms = GetRealms(realm, true);
-	if(has_vals)
+	for(auto it = realms.begin(); it != realms.end(); ++it)
 	{
+		auto dlk = it->second.find(key);
+		if(dlk != it->second.end())
+		{
+			ReleaseValue(dlk->second);
+			if(!data)
+				it->second.erase(dlk);
+		}
+		if(data)
+			StoreValue(it->second[key], *data);
+	}
+	CompactArena();
+	m_dirty.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+Lua::ReturnValues Session::GetMany(std::string const& realm, std::string const& keys)
+{
+	Touch();
+	
+	std::string out(1, '\x08');
+	m_mutex.lock_read();
+	std::lock_guard<rw_mutex> mx(m_mutex, std::adopt_lock);
+	Session::RealmIterator realms = GetRealms(realm, false);
+	std::string key;
+	for(char const* p = keys.data(), *end = p + keys.size(); end - p >= 4; )
+	{
+		std::size_t size = 0;
+		for(int i = 3; i >= 0; --i)
+			size = (size << 8) | static_cast<unsigned char>(p[i]);
+		p += 4;
+		if(static_cast<std::size_t>(end - p) < size)
+			break;
+		key.assign(p, size);
+		p += size;
+		
 		for(auto it = realms.begin(); it != realms.end(); ++it)
 		{
-			it->second[key] = vals;
+			auto itk = it->second.find(key);
+			if(itk != it->second.end())
+			{
+				EncodeString(out, key);
+				out.append(ValueData(itk->second), itk->second.m_size);
+				break;
+			}
 		}
 	}
-	else
+	out += '\0';
+	return Lua::Return(out);
+}
+
+bool Session::SetMany(std::string const& realm, std::string const& values)
+{
+	Touch();
+	
+	if(values.empty() || values[0] != '\x08' || !ValidValue(values))
+		return false;
+	
+	std::lock_guard<rw_mutex> mx(m_mutex);
+	Session::RealmIterator realms = GetRealms(realm, true);
+	std::string key, value;
+	for(char const* p = values.data() + 1, *end = values.data() + values.size(); *p != 0; )
 	{
+		bool const named = DecodeString(p, key);
+		if(!named)
+			ValidValue(p, end, 1); // Skip the key
+		char const* const begin = p;
+		ValidValue(p, end, 1);
+		if(!named)
+			continue;
+		value.assign(begin, p);
 		for(auto it = realms.begin(); it != realms.end(); ++it)
 		{
 			auto dlk = it->second.find(key);
 			if(dlk != it->second.end())
-				it->second.erase(dlk);
+				ReleaseValue(dlk->second);
+			StoreValue(it->second[key], value);
+		}
+	}
+	CompactArena();
+	m_dirty.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+// With "*", every realm merged.
+Lua::ReturnValues Session::GetRealm(std::string const& realm)
+{
+	Touch();
+	
+	std::string out(1, '\x08');
+	m_mutex.lock_read();
+	std::lock_guard<rw_mutex> mx(m_mutex, std::adopt_lock);
+	Session::RealmIterator realms = GetRealms(realm, false);
+	for(auto it = realms.begin(); it != realms.end(); ++it)
+	{
+		for(auto itv = it->second.begin(); itv != it->second.end(); ++itv)
+		{
+			EncodeString(out, itv->first);
+			out.append(ValueData(itv->second), itv->second.m_size);
 		}
 	}
-	return has_vals || (!var) || var->IsNil() || (var->GetType() == Lua::TP_NONE);
+	out += '\0';
+	return Lua::Return(out);
 }
 
 Lua::ReturnValues Session::GetVar(std::string const& realm, std::string const& key)
@@ -134,16 +365,20 @@ Lua::ReturnValues Session::GetVar(std::string const& realm, std::string const& k
 	{
 		auto itk = it->second.find(key);
 		if(itk != it->second.end())
-			return itk->second;
+			return Lua::Return(std::string(ValueData(itk->second), itk->second.m_size));
 	}
 	return Lua::Return();
 }
 
 // LuaSessionInterface
-LuaSessionInterface::LuaSessionInterface() : m_manager(nullptr), m_realSession(nullptr) {}
+LuaSessionInterface::LuaSessionInterface() : m_manager(nullptr), m_realSession(nullptr), m_resolved(false), m_mode(SM_SERVER) {}
 
 bool LuaSessionInterface::getCookieString(std::string& s, std::string const& domain) const
 {
+	// The script didn't use the session: the browser's cookie is still right.
+	if(!m_resolved)
+		return false;
+	
 	if(!m_realSession || !m_realSession->IsValid())
 	{
 		// We didn't have a session key to begin with.
@@ -151,7 +386,7 @@ bool LuaSessionInterface::getCookieString(std::string& s, std::string const& dom
 			return false;
 		
 		// We deleted the session.
-		s = g_settings.m_sessionName + "=_; Expires=Thu, 01 Jan 1970 00:00:00 GMT";
+		s = g_settings->m_sessionName + "=_; Expires=Thu, 01 Jan 1970 00:00:00 GMT";
 		return true;
 	}
 	
@@ -164,16 +399,27 @@ bool LuaSessionInterface::getCookieString(std::string& s, std::string const& dom
 	std::strftime(cookie_str_fmt, sizeof(cookie_str_fmt), "%a, %d %b %Y %H:%M:%S GMT", &gmt_time);
 	
 	// We have a session!
-	s = g_settings.m_sessionName + "=" + m_realSession->m_sessionKey + "; Expires="
+	std::string value;
+	if(m_mode == SM_COOKIE)
+	{
+		value = sealCookie();
+		// Browsers would drop it anyway.
+		if(value.size() > 4000)
+		{
+			LogError("Session too large for SessionMode \"cookie\", not saved.");
+			return false;
+		}
+	}
+	s = g_settings->m_sessionName + "=" + (m_mode == SM_COOKIE ? value : m_realSession->m_sessionKey) + "; Expires="
 		+ cookie_str_fmt + ";";
 		
-	if(g_settings.m_sessionCookieHttpOnly)
+	if(g_settings->m_sessionCookieHttpOnly)
 		s.append(" HttpOnly;");
-	if(g_settings.m_sessionCookieSecure)
+	if(g_settings->m_sessionCookieSecure)
 		s.append(" Secure;");
-	if(g_settings.m_sessionCookieSameSite == "Strict")
+	if(g_settings->m_sessionCookieSameSite == "Strict")
 		s.append(" SameSite=Strict;");
-	else if(g_settings.m_sessionCookieSameSite == "Lax")
+	else if(g_settings->m_sessionCookieSameSite == "Lax")
 		s.append(" SameSite=Lax;");
 	s.append(" Path=/;");
 	if(!domain.empty())
@@ -188,8 +434,28 @@ bool LuaSessionInterface::getCookieString(std::string& s, std::string const& dom
 void LuaSessionInterface::Init(SessionManager& manager, SessionDetectData const& sdd)
 {
 	m_manager = &manager;
-	m_realSession = manager.findSession(sdd);
+	m_realSession = nullptr;
 	m_sdd = sdd;
+	m_resolved = false;
+	m_mode = g_settings->m_sessionMode;
+	m_localSession.reset();
+}
+
+void LuaSessionInterface::resolve()
+{
+	if(m_resolved)
+		return;
+	m_resolved = true;
+	if(!m_manager)
+		throw std::runtime_error("No session manager in LuaSessionInterface!");
+	if(m_sdd.m_sessionKey.empty())
+		return;
+	if(m_mode == SM_COOKIE)
+		openCookie();
+	else if(m_mode == SM_SHARED)
+		openShared();
+	else
+		m_realSession = m_manager->findSession(m_sdd);
 }
 
 void LuaSessionInterface::DeleteSessionTicket()
@@ -198,7 +464,14 @@ void LuaSessionInterface::DeleteSessionTicket()
 		return;
 	if(!m_manager)
 		throw std::runtime_error("No session manager in LuaSessionInterface!");
-	m_manager->DeleteSession(m_realSession);
+	if(m_mode == SM_SERVER)
+		m_manager->DeleteSession(m_realSession);
+	else
+	{
+		if(m_mode == SM_SHARED)
+			SharedSessions::Remove(m_realSession->m_sessionKey);
+		m_localSession.reset();
+	}
 	m_realSession = nullptr;
 }
 
@@ -208,16 +481,29 @@ void LuaSessionInterface::CreateNewSessionTicket()
 		return;
 	if(!m_manager)
 		throw std::runtime_error("No session manager in LuaSessionInterface!");
-	m_realSession = m_manager->CreateSession(m_sdd);
+	if(m_mode == SM_SERVER)
+		m_realSession = m_manager->CreateSession(m_sdd);
+	else
+	{
+		// Shared keys are only claimed by Finish: with CSPRNG keys, a
+		// collision isn't worth a round trip.
+		std::string key;
+		if(m_mode == SM_SHARED)
+			SessionManager::CreateSessionKey(key);
+		m_localSession.reset(new Session(m_manager, key, m_sdd));
+		m_realSession = m_localSession.get();
+	}
 }
 
-bool LuaSessionInterface::read() const
+bool LuaSessionInterface::read()
 {
+	resolve();
 	return !!m_realSession;
 }
 
 void LuaSessionInterface::write()
 {
+	resolve();
 	CreateNewSessionTicket();
 }
 
@@ -249,7 +535,7 @@ void LuaSessionInterface::Clear(std::string const& realm)
 	m_realSession->Clear(realm);
 }
 
-bool LuaSessionInterface::SetVar(std::string const& realm, std::string const& key, Lua::Variable* val)
+bool LuaSessionInterface::SetVar(std::string const& realm, std::string const& key, std::string const* val)
 {
 	write();
 	return m_realSession->SetVar(realm, key, val);
@@ -262,34 +548,209 @@ Lua::ReturnValues LuaSessionInterface::GetVar(std::string const& realm, std::str
 	return m_realSession->GetVar(realm, key);
 }
 
+// An empty encoded table
+static std::string const g_noValues("\x08\0", 2);
+
+Lua::ReturnValues LuaSessionInterface::GetMany(std::string const& realm, std::string const& keys)
+{
+	if(!read())
+		return Lua::Return(g_noValues);
+	return m_realSession->GetMany(realm, keys);
+}
+
+bool LuaSessionInterface::SetMany(std::string const& realm, std::string const& values)
+{
+	write();
+	return m_realSession->SetMany(realm, values);
+}
+
+Lua::ReturnValues LuaSessionInterface::GetRealm(std::string const& realm)
+{
+	if(!read())
+		return Lua::Return(g_noValues);
+	return m_realSession->GetRealm(realm);
+}
+
 // SessionManager
 SessionManager g_sessions;
 
+static inline std::size_t HashKey(std::string const& key)
+{
+	return HashBytes(key.data(), key.size());
+}
+
+std::size_t SessionManager::Shard::find(std::size_t hash, std::string const& key) const
+{
+	if(m_slots.empty())
+		return Shard::npos;
+	std::size_t const mask = m_slots.size() - 1;
+	for(std::size_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		Slot const& slot = m_slots[i];
+		if(!slot.m_session)
+			return Shard::npos;
+		if(slot.m_hash == hash && slot.m_session->m_sessionKey == key)
+			return i;
+	}
+}
+
+bool SessionManager::Shard::insert(std::size_t hash, std::unique_ptr<Session>& session)
+{
+	if(find(hash, session->m_sessionKey) != Shard::npos)
+		return false;
+	
+	// Keep the load factor under 3/4.
+	if((m_count + 1) * 4 > m_slots.size() * 3)
+	{
+		std::vector<Slot> old;
+		old.swap(m_slots);
+		m_slots.resize(old.empty() ? 64 : old.size() * 2);
+		std::size_t const mask = m_slots.size() - 1;
+		for(auto it = old.begin(); it != old.end(); ++it)
+		{
+			if(!it->m_session)
+				continue;
+			std::size_t i = it->m_hash & mask;
+			while(m_slots[i].m_session)
+				i = (i + 1) & mask;
+			m_slots[i].m_hash = it->m_hash;
+			m_slots[i].m_session = std::move(it->m_session);
+		}
+	}
+	
+	std::size_t const mask = m_slots.size() - 1;
+	std::size_t i = hash & mask;
+	while(m_slots[i].m_session)
+		i = (i + 1) & mask;
+	m_slots[i].m_hash = hash;
+	m_slots[i].m_session = std::move(session);
+	++m_count;
+	return true;
+}
+
+// By address, for timers whose session may have been deleted.
+std::size_t SessionManager::Shard::locate(std::size_t hash, Session const* session) const
+{
+	if(m_slots.empty())
+		return npos;
+	std::size_t const mask = m_slots.size() - 1;
+	for(std::size_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		Slot const& slot = m_slots[i];
+		if(!slot.m_session)
+			return npos;
+		if(slot.m_session.get() == session)
+			return i;
+	}
+}
+
+void SessionManager::Shard::schedule(Timer const& timer, std::time_t expiration)
+{
+	if(expiration <= m_wheelTime)
+		expiration = m_wheelTime + 1;
+	m_wheel[static_cast<std::size_t>(expiration) % WHEEL_SIZE].push_back(timer);
+}
+
+void SessionManager::Shard::erase(std::size_t index)
+{
+	std::size_t const mask = m_slots.size() - 1;
+	m_slots[index].m_session.reset();
+	--m_count;
+	
+	// Pull back the entries that probed past the hole.
+	std::size_t hole = index;
+	for(std::size_t i = (index + 1) & mask; m_slots[i].m_session; i = (i + 1) & mask)
+	{
+		std::size_t const home = m_slots[i].m_hash & mask;
+		// Can it live in the hole, ie. is the hole cyclically in [home, i)?
+		if(((i - home) & mask) >= ((i - hole) & mask))
+		{
+			m_slots[hole].m_hash = m_slots[i].m_hash;
+			m_slots[hole].m_session = std::move(m_slots[i].m_session);
+			hole = i;
+		}
+	}
+}
+
+SessionManager::SessionManager() : m_shards(new Shard[1]), m_shardCount(1), m_logDeletes(false) {}
+
+void SessionManager::Setup(int shards, bool persist)
+{
+	m_shards.reset(new Shard[shards]);
+	m_shardCount = static_cast<std::size_t>(shards);
+	m_logDeletes = persist;
+	
+	std::time_t const now = GetCurrentTimeT();
+	for(std::size_t s = 0; s < m_shardCount; ++s)
+		m_shards[s].m_wheelTime = now;
+}
+
+// The low bits pick the slot inside the shard.
+SessionManager::Shard& SessionManager::shardOf(std::size_t hash)
+{
+	return m_shards[(hash >> 24) % m_shardCount];
+}
+
 Session* SessionManager::CreateSession(SessionDetectData const& sdd)
 {
-	std::lock_guard<rw_mutex> mx(m_mutex);
 	std::string skey;
 	
 	while(true)
 	{
 		SessionManager::CreateSessionKey(skey);
-		auto it = m_sessions.emplace(std::piecewise_construct, std::make_tuple(skey), std::make_tuple(this,skey,sdd));
-		if(it.second == true)
-			return &(it.first->second);
+		std::size_t const hash = HashKey(skey);
+		std::unique_ptr<Session> session(new Session(this, skey, sdd));
+		Session* result = session.get();
+		
+		Shard& shard = shardOf(hash);
+		std::lock_guard<rw_mutex> mx(shard.m_mutex);
+		if(shard.insert(hash, session))
+		{
+			shard.schedule(Shard::Timer{hash, result}, result->m_expiration.load());
+			return result;
+		}
 	}
 }
 
-void SessionManager::CleanExpiredSessions()
+void SessionManager::ExpireSessions()
 {
-	std::lock_guard<rw_mutex> mx(m_mutex);
-	for(auto it = m_sessions.begin(); it != m_sessions.end(); )
+	std::size_t const batch = 128; // Timers handled per lock
+	std::time_t const now = GetCurrentTimeT();
+	std::vector<Shard::Timer> due;
+	for(std::size_t s = 0; s < m_shardCount; ++s)
 	{
-		if(!(it->second.IsValid()))
+		Shard& shard = m_shards[s];
+		due.clear();
+		{
+			std::lock_guard<rw_mutex> mx(shard.m_mutex);
+			// After a long stall, a single turn of the wheel covers everything.
+			if(now - shard.m_wheelTime > Shard::WHEEL_SIZE)
+				shard.m_wheelTime = now - Shard::WHEEL_SIZE;
+			while(shard.m_wheelTime < now)
+			{
+				++shard.m_wheelTime;
+				std::vector<Shard::Timer>& bucket = shard.m_wheel[static_cast<std::size_t>(shard.m_wheelTime) % Shard::WHEEL_SIZE];
+				due.insert(due.end(), bucket.begin(), bucket.end());
+				bucket.clear();
+			}
+		}
+		
+		for(std::size_t b = 0; b < due.size(); b += batch)
 		{
-			m_sessions.erase(it++);
+			std::lock_guard<rw_mutex> mx(shard.m_mutex);
+			std::size_t const end = std::min(due.size(), b + batch);
+			for(std::size_t t = b; t < end; ++t)
+			{
+				std::size_t i = shard.locate(due[t].m_hash, due[t].m_session);
+				if(i == Shard::npos)
+					continue; // Deleted
+				Session* session = shard.m_slots[i].m_session.get();
+				if(!session->IsValid())
+					shard.erase(i);
+				else
+					shard.schedule(due[t], session->m_expiration.load());
+			}
 		}
-		else
-			++it;
 	}
 }
 
@@ -297,54 +758,388 @@ void SessionManager::DeleteSession(Session* session)
 {
 	if(!session)
 		return;
-	std::lock_guard<rw_mutex> mx(m_mutex);
+	std::size_t const hash = HashKey(session->m_sessionKey);
+	Shard& shard = shardOf(hash);
+	std::lock_guard<rw_mutex> mx(shard.m_mutex);
+	
+	std::size_t i = shard.find(hash, session->m_sessionKey);
+	if(i == Shard::npos)
+		return;
+	if(m_logDeletes)
+	{
+		std::lock_guard<std::mutex> lg(m_deletedMutex);
+		m_deleted.push_back(session->m_sessionKey);
+	}
+	shard.erase(i);
+}
+
+// SessionStore records: a type byte, the payload size (u32) and the payload.
+// Integers are little endian, strings are prefixed by their u32 size.
+//   'S': key, expiration (i64), address, user agent, languages,
+//        realm count, then each realm's name, variable count and
+//        name / encoded value pairs.
+//   'D': key of a deleted session.
+static void PutU32(std::string& out, std::uint32_t v)
+{
+	for(int i = 0; i < 4; ++i)
+		out += static_cast<char>((v >> (8 * i)) & 0xFF);
+}
+
+static void PutI64(std::string& out, std::int64_t v)
+{
+	std::uint64_t const u = static_cast<std::uint64_t>(v);
+	for(int i = 0; i < 8; ++i)
+		out += static_cast<char>((u >> (8 * i)) & 0xFF);
+}
+
+static void PutString(std::string& out, char const* data, std::size_t size)
+{
+	PutU32(out, static_cast<std::uint32_t>(size));
+	out.append(data, size);
+}
+
+static void PutString(std::string& out, std::string const& s)
+{
+	PutString(out, s.data(), s.size());
+}
+
+// Fills in the payload size of the record started at begin.
+static void EndRecord(std::string& out, std::size_t begin)
+{
+	std::uint32_t const size = static_cast<std::uint32_t>(out.size() - begin - 5);
+	for(int i = 0; i < 4; ++i)
+		out[begin + 1 + i] = static_cast<char>((size >> (8 * i)) & 0xFF);
+}
+
+struct RecordReader {
+	char const* m_p;
+	char const* m_end;
+	
+	bool u32(std::uint32_t& v)
+	{
+		if(m_end - m_p < 4)
+			return false;
+		v = 0;
+		for(int i = 3; i >= 0; --i)
+			v = (v << 8) | static_cast<unsigned char>(m_p[i]);
+		m_p += 4;
+		return true;
+	}
+	bool i64(std::int64_t& v)
+	{
+		if(m_end - m_p < 8)
+			return false;
+		std::uint64_t u = 0;
+		for(int i = 7; i >= 0; --i)
+			u = (u << 8) | static_cast<unsigned char>(m_p[i]);
+		v = static_cast<std::int64_t>(u);
+		m_p += 8;
+		return true;
+	}
+	bool str(std::string& s)
+	{
+		std::uint32_t size;
+		if(!u32(size) || static_cast<std::size_t>(m_end - m_p) < size)
+			return false;
+		s.assign(m_p, size);
+		m_p += size;
+		return true;
+	}
+};
+
+void Session::WriteRealms(std::string& out) const
+{
+	PutU32(out, static_cast<std::uint32_t>(m_realms.size()));
+	for(auto itr = m_realms.begin(); itr != m_realms.end(); ++itr)
+	{
+		PutString(out, itr->first);
+		PutU32(out, static_cast<std::uint32_t>(itr->second.size()));
+		for(auto itv = itr->second.begin(); itv != itr->second.end(); ++itv)
+		{
+			PutString(out, itv->first);
+			PutString(out, ValueData(itv->second), itv->second.m_size);
+		}
+	}
+}
+
+bool Session::ReadRealms(char const*& p, char const* end)
+{
+	RecordReader rec{p, end};
+	std::uint32_t realms;
+	if(!rec.u32(realms))
+		return false;
+	for(std::uint32_t r = 0; r < realms; ++r)
+	{
+		std::string realm;
+		std::uint32_t vars;
+		if(!rec.str(realm) || !rec.u32(vars))
+			return false;
+		Session::Realm& values = m_realms[realm];
+		for(std::uint32_t v = 0; v < vars; ++v)
+		{
+			std::string var, value;
+			if(!rec.str(var) || !rec.str(value) || !ValidValue(value))
+				return false;
+			StoreValue(values[var], value);
+		}
+	}
+	p = rec.m_p;
+	return true;
+}
+
+// Cookie payload: version (1), expiration (i64), hashes (u32) of the
+// address, user agent and languages, then the realms.
+static std::uint32_t IdentityHash(char const* s)
+{
+	return static_cast<std::uint32_t>(s ? HashBytes(s, std::strlen(s)) : HashBytes("", 0));
+}
+
+static std::uint32_t IdentityHash(std::string const& s)
+{
+	return static_cast<std::uint32_t>(HashBytes(s.data(), s.size()));
+}
+
+std::string LuaSessionInterface::sealCookie() const
+{
+	std::string payload(1, '\x01');
+	m_realSession->m_mutex.lock_read();
+	std::lock_guard<rw_mutex> mx(m_realSession->m_mutex, std::adopt_lock);
+	PutI64(payload, m_realSession->m_expiration.load());
+	PutU32(payload, IdentityHash(m_realSession->m_sds.m_address));
+	PutU32(payload, IdentityHash(m_realSession->m_sds.m_useragent));
+	PutU32(payload, IdentityHash(m_realSession->m_sds.m_languages));
+	m_realSession->WriteRealms(payload);
+	return SignedCookie::Seal(payload);
+}
+
+void LuaSessionInterface::openCookie()
+{
+	std::string payload;
+	if(!SignedCookie::Open(m_sdd.m_sessionKey, payload) || payload.empty() || payload[0] != '\x01')
+		return;
+	
+	RecordReader rec{payload.data() + 1, payload.data() + payload.size()};
+	std::int64_t expiration;
+	std::uint32_t address, useragent, languages;
+	if(!rec.i64(expiration) || expiration < GetCurrentTimeT()
+		|| !rec.u32(address) || !rec.u32(useragent) || !rec.u32(languages))
+		return;
+	
+	// Same scoring as sessionMatches.
+	int const score =
+		(address == IdentityHash(m_sdd.m_address) ? g_settings->m_sessionIpScore : 0) +
+		(useragent == IdentityHash(m_sdd.m_useragent) ? g_settings->m_sessionUserAgentScore : 0) +
+		(languages == IdentityHash(m_sdd.m_languages) ? g_settings->m_sessionLanguageScore : 0);
+	if(g_settings->m_sessionTargetScore > 0 && score < g_settings->m_sessionTargetScore)
+		return;
 	
-	auto it = m_sessions.find(session->m_sessionKey);
-	if(it == m_sessions.end())
+	std::unique_ptr<Session> session(new Session(m_manager, std::string(), m_sdd));
+	session->m_expiration = static_cast<std::time_t>(expiration);
+	if(!session->ReadRealms(rec.m_p, rec.m_end))
 		return;
-	m_sessions.erase(it);
+	m_localSession = std::move(session);
+	m_realSession = m_localSession.get();
+}
+
+// Shared payload: address, user agent, languages, then the realms.
+void LuaSessionInterface::openShared()
+{
+	std::string payload;
+	std::int64_t expiration;
+	if(!SharedSessions::Load(m_sdd.m_sessionKey, payload, expiration))
+		return;
+	
+	RecordReader rec{payload.data(), payload.data() + payload.size()};
+	SessionDetectStorage sds;
+	if(!rec.str(sds.m_address) || !rec.str(sds.m_useragent) || !rec.str(sds.m_languages))
+		return;
+	if(!sessionMatches(m_sdd, sds, true))
+		return; // Safety measure. The user identity doesn't seem to match!
+	
+	std::unique_ptr<Session> session(new Session(m_manager, m_sdd.m_sessionKey, m_sdd));
+	session->m_expiration = static_cast<std::time_t>(expiration);
+	if(!session->ReadRealms(rec.m_p, rec.m_end))
+		return;
+	m_localSession = std::move(session);
+	m_realSession = m_localSession.get();
+}
+
+void LuaSessionInterface::Finish()
+{
+	if(m_mode != SM_SHARED || !m_realSession || !m_realSession->IsValid())
+		return;
+	
+	std::string payload;
+	{
+		m_realSession->m_mutex.lock_read();
+		std::lock_guard<rw_mutex> mx(m_realSession->m_mutex, std::adopt_lock);
+		PutString(payload, m_realSession->m_sds.m_address);
+		PutString(payload, m_realSession->m_sds.m_useragent);
+		PutString(payload, m_realSession->m_sds.m_languages);
+		m_realSession->WriteRealms(payload);
+	}
+	if(!SharedSessions::Store(m_realSession->m_sessionKey, m_realSession->m_expiration.load(), payload))
+	{
+		LogError("Shared session store full (SharedSessionMemory / SharedSessionSlots), session not saved.");
+		m_realSession = nullptr; // No cookie for it
+		m_localSession.reset();
+	}
+}
+
+void SessionManager::Collect(std::string& out, bool all)
+{
+	{
+		std::vector<std::string> deleted;
+		{
+			std::lock_guard<std::mutex> lg(m_deletedMutex);
+			deleted.swap(m_deleted);
+		}
+		if(!all)
+		{
+			for(auto it = deleted.begin(); it != deleted.end(); ++it)
+			{
+				std::size_t const begin = out.size();
+				out += 'D';
+				PutU32(out, 0);
+				PutString(out, *it);
+				EndRecord(out, begin);
+			}
+		}
+	}
+	
+	for(std::size_t s = 0; s < m_shardCount; ++s)
+	{
+		Shard& shard = m_shards[s];
+		shard.m_mutex.lock_read();
+		std::lock_guard<rw_mutex> mx(shard.m_mutex, std::adopt_lock);
+		for(auto it = shard.m_slots.begin(); it != shard.m_slots.end(); ++it)
+		{
+			Session* session = it->m_session.get();
+			if(!session || !session->IsValid())
+				continue;
+			
+			// Under the lock: a change made after the flag is cleared is
+			// in the next Collect. Reads only move the expiration.
+			session->m_mutex.lock_read();
+			std::lock_guard<rw_mutex> smx(session->m_mutex, std::adopt_lock);
+			bool const dirty = session->m_dirty.exchange(false);
+			std::time_t const expiration = session->m_expiration.load();
+			if(!dirty && !all && expiration == session->m_loggedExpiration)
+				continue;
+			session->m_loggedExpiration = expiration;
+			std::size_t const begin = out.size();
+			out += 'S';
+			PutU32(out, 0);
+			PutString(out, session->m_sessionKey);
+			PutI64(out, expiration);
+			PutString(out, session->m_sds.m_address);
+			PutString(out, session->m_sds.m_useragent);
+			PutString(out, session->m_sds.m_languages);
+			session->WriteRealms(out);
+			EndRecord(out, begin);
+		}
+	}
+}
+
+std::size_t SessionManager::Restore(char const* data, std::size_t size)
+{
+	// Latest payload of each session; a torn record ends the log.
+	std::map<std::string, std::string> records;
+	RecordReader log{data, data + size};
+	while(log.m_end - log.m_p >= 5)
+	{
+		char const type = *log.m_p++;
+		std::uint32_t length;
+		if(!log.u32(length) || static_cast<std::size_t>(log.m_end - log.m_p) < length)
+			break;
+		RecordReader rec{log.m_p, log.m_p + length};
+		log.m_p += length;
+		
+		std::string key;
+		if(!rec.str(key))
+			continue;
+		if(type == 'S')
+			records[key].assign(rec.m_p, rec.m_end);
+		else if(type == 'D')
+			records.erase(key);
+	}
+	
+	std::time_t const now = GetCurrentTimeT();
+	std::size_t restored = 0;
+	for(auto it = records.begin(); it != records.end(); ++it)
+	{
+		RecordReader rec{it->second.data(), it->second.data() + it->second.size()};
+		std::int64_t expiration;
+		SessionDetectStorage sds;
+		if(!rec.i64(expiration) || expiration < now
+			|| !rec.str(sds.m_address) || !rec.str(sds.m_useragent) || !rec.str(sds.m_languages))
+			continue;
+		
+		SessionDetectData sdd;
+		sdd.m_address = sds.m_address.c_str();
+		sdd.m_useragent = sds.m_useragent.c_str();
+		sdd.m_languages = sds.m_languages.c_str();
+		std::unique_ptr<Session> session(new Session(this, it->first, sdd));
+		session->m_sds.m_sessionKey = it->first;
+		session->m_expiration = static_cast<std::time_t>(expiration);
+		
+		if(!session->ReadRealms(rec.m_p, rec.m_end))
+			continue;
+		
+		std::size_t const hash = HashKey(it->first);
+		Session* result = session.get();
+		Shard& shard = shardOf(hash);
+		std::lock_guard<rw_mutex> mx(shard.m_mutex);
+		if(shard.insert(hash, session))
+		{
+			shard.schedule(Shard::Timer{hash, result}, result->m_expiration.load());
+			++restored;
+		}
+	}
+	return restored;
 }
 
 Session* SessionManager::findSession(SessionDetectData const& sdd)
 {
-	auto it = m_sessions.begin();
+	Session* session = nullptr;
 	
 	{
-		m_mutex.lock_read();
-		std::lock_guard<rw_mutex> mx(m_mutex, std::adopt_lock);
+		std::size_t const hash = HashKey(sdd.m_sessionKey);
+		Shard& shard = shardOf(hash);
+		shard.m_mutex.lock_read();
+		std::lock_guard<rw_mutex> mx(shard.m_mutex, std::adopt_lock);
 		
-		it = m_sessions.find(sdd.m_sessionKey);
-		if(it == m_sessions.end())
+		std::size_t i = shard.find(hash, sdd.m_sessionKey);
+		if(i == Shard::npos)
 			return nullptr;
+		session = shard.m_slots[i].m_session.get();
 	}
 	
-	it->second.m_mutex.lock_read();
-	std::lock_guard<rw_mutex> mx(it->second.m_mutex, std::adopt_lock);
-	if(!sessionMatches(sdd, it->second.m_sds, true))
+	session->m_mutex.lock_read();
+	std::lock_guard<rw_mutex> mx(session->m_mutex, std::adopt_lock);
+	if(!sessionMatches(sdd, session->m_sds, true))
 		return nullptr; // Safety measure. The user identity doesn't seem to match!
 	
-	it->second.m_mutex.chlock_w();
-	it->second.m_sds = sdd;
-	return &(it->second);
+	// Usually the same browser as last time: stay a reader.
+	if(sessionIdentical(sdd, session->m_sds))
+		return session;
+	
+	session->m_mutex.chlock_w();
+	session->m_sds = sdd;
+	session->m_dirty.store(true, std::memory_order_relaxed);
+	return session;
 }
 
-#include "randutils.hpp"
-typedef randutils::mt19937_rng random_generator;
-typedef std::uniform_int_distribution<char> random_distribution;
-
 static char const g_selCharacters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-static int const g_sc_first = 0;
-static int const g_sc_last = (sizeof(g_selCharacters) / sizeof(*g_selCharacters))-2;
+static unsigned const g_sc_count = sizeof(g_selCharacters) - 1;
 
 void SessionManager::CreateSessionKey(std::string& result)
 {
-	int const klen = g_settings.m_sessionKeyLen;
+	int const klen = g_settings->m_sessionKeyLen;
 	
-	random_generator generator;
 	result.resize(klen);
-	
 	for(int i = 0; i < klen; ++i)
 	{
-		result[i] = g_selCharacters[generator.uniform(g_sc_first, g_sc_last)];
+		result[i] = g_selCharacters[SecureRandom::Below(g_sc_count)];
 	}
 }
@@ -3,6 +3,11 @@
 #include <string>
 #include <chrono>
 #include <ctime>
+#include <vector>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <cstdint>
 #include "state.h"
 #include "rw_mutex.h"
 #include "settings.h"
@@ -75,12 +80,20 @@ bool sessionMatches(T const& a, U const& b, bool skipSessionKey = false)
 {
 	return
 		(skipSessionKey || impl::is_equal(a.m_sessionKey, b.m_sessionKey)) &&
-		(g_settings.m_sessionTargetScore <= 0 || (
+		(g_settings->m_sessionTargetScore <= 0 || (
 		(
-			((impl::is_equal(a.m_address, b.m_address)) ? g_settings.m_sessionIpScore : 0) +
-			((impl::is_equal(a.m_useragent, b.m_useragent)) ? g_settings.m_sessionUserAgentScore : 0) +
-			((impl::is_equal(a.m_languages, b.m_languages)) ? g_settings.m_sessionLanguageScore : 0)
-		) >= g_settings.m_sessionTargetScore));
+			((impl::is_equal(a.m_address, b.m_address)) ? g_settings->m_sessionIpScore : 0) +
+			((impl::is_equal(a.m_useragent, b.m_useragent)) ? g_settings->m_sessionUserAgentScore : 0) +
+			((impl::is_equal(a.m_languages, b.m_languages)) ? g_settings->m_sessionLanguageScore : 0)
+		) >= g_settings->m_sessionTargetScore));
+}
+
+template <typename T, typename U>
+bool sessionIdentical(T const& a, U const& b)
+{
+	return impl::is_equal(a.m_address, b.m_address)
+		&& impl::is_equal(a.m_useragent, b.m_useragent)
+		&& impl::is_equal(a.m_languages, b.m_languages);
 }
 
 
@@ -93,12 +106,27 @@ class Session {
 	
 public:
 	typedef std::chrono::system_clock expiration_clock;
-	typedef std::map<std::string, Lua::ReturnValues> Realm;
+	
+	// A value encoded by the prelude's session codec. Up to INLINE_SIZE
+	// bytes are kept in place, larger ones in the session's arena.
+	struct Value {
+		enum { INLINE_SIZE = 20 };
+		std::uint32_t m_size;
+		union {
+			char m_inline[INLINE_SIZE];
+			std::uint32_t m_offset;
+		};
+	};
+	typedef std::map<std::string, Value> Realm;
 	
 private:
 	rw_mutex m_mutex;
 	std::map<std::string, Realm> m_realms;
+	std::string m_arena;
+	std::size_t m_garbage; // Bytes of m_arena no longer referenced
 	std::atomic<std::time_t> m_expiration;
+	std::atomic<bool> m_dirty; // Changed since the last SessionStore record
+	std::time_t m_loggedExpiration; // In the last record, Collect's only
 	std::string m_sessionKey;
 	SessionDetectStorage m_sds;
 
@@ -116,9 +144,19 @@ private:
 	// DOES NOT LOCK!
 	RealmIterator GetRealms(std::string const& realm, bool bCreate);
 	
-	// DOES NOT LOCK!
+	// DOES NOT LOCK! The expiration only: changes set m_dirty under the lock.
 	void Touch();
 	
+	// DO NOT LOCK!
+	void StoreValue(Value& value, std::string const& data);
+	void ReleaseValue(Value const& value);
+	char const* ValueData(Value const& value) const;
+	void CompactArena();
+	
+	// DO NOT LOCK! As in the SessionStore records.
+	void WriteRealms(std::string& out) const;
+	bool ReadRealms(char const*& p, char const* end);
+	
 public:
 	Session(SessionManager*, std::string, SessionDetectData const&);
 	
@@ -127,9 +165,16 @@ public:
 	void Delete();
 	bool HasRealm(std::string const& realm);
 	void Clear(std::string const& realm);
-	bool SetVar(std::string const& realm, std::string const& var, Lua::Variable* data);
+	// Null data removes the variable.
+	bool SetVar(std::string const& realm, std::string const& var, std::string const* data);
 	Lua::ReturnValues GetVar(std::string const& realm, std::string const& var);
 	
+	// Batches, under one lock. keys are u32-prefixed names; values and the
+	// results are encoded tables of name -> value.
+	Lua::ReturnValues GetMany(std::string const& realm, std::string const& keys);
+	bool SetMany(std::string const& realm, std::string const& values);
+	Lua::ReturnValues GetRealm(std::string const& realm);
+	
 	bool Matches(SessionDetectData*);
 };
 
@@ -138,38 +183,108 @@ class LuaSessionInterface {
 	SessionManager* m_manager;
 	Session* m_realSession;
 	SessionDetectData m_sdd;
+	bool m_resolved; // Looked up on the first use of the Session API
+	SessionMode m_mode; // As of Init
+	std::unique_ptr<Session> m_localSession; // Owns m_realSession, except in server mode
 	
 	void CreateNewSessionTicket();
 	void DeleteSessionTicket();
 	
+	// Cookie mode: m_sdd.m_sessionKey is the signed cookie.
+	void openCookie();
+	std::string sealCookie() const;
+	
+	// Shared mode: copied out of SharedSessions, and back by Finish.
+	void openShared();
+	
+	void resolve();
 	void write();
-	bool read() const;
+	bool read();
 public:
 	LuaSessionInterface();
 	void Init(SessionManager&, SessionDetectData const&);
 	
+	// After the script ran successfully.
+	void Finish();
+	
 	bool hasRealSession() const;
 	void Start();
 	void Delete();
 	bool HasRealm(std::string const& realm);
 	void Clear(std::string const& realm);
-	bool SetVar(std::string const& realm, std::string const& var, Lua::Variable* data);
+	bool SetVar(std::string const& realm, std::string const& var, std::string const* data);
 	Lua::ReturnValues GetVar(std::string const& realm, std::string const& var);
+	Lua::ReturnValues GetMany(std::string const& realm, std::string const& keys);
+	bool SetMany(std::string const& realm, std::string const& values);
+	Lua::ReturnValues GetRealm(std::string const& realm);
 	
 	bool getCookieString(std::string&, std::string const& domain) const;
 };
 
 
 class SessionManager {
-	rw_mutex m_mutex;
-	std::map<std::string, Session> m_sessions;
+	// Open-addressing table (linear probing, backward shift deletion),
+	// with a timer wheel of one-second buckets driving the expiry. Sessions
+	// are filed under the second they expire at; when that bucket comes
+	// around, the ones that were touched since are filed again.
+	struct Shard {
+		struct Slot {
+			std::size_t m_hash;
+			std::unique_ptr<Session> m_session; // Null when free
+		};
+		struct Timer {
+			std::size_t m_hash;
+			Session const* m_session; // Only compared: may be gone already
+		};
+		enum { WHEEL_SIZE = 256 };
+		inline Shard() : m_count(0), m_wheel(WHEEL_SIZE), m_wheelTime(0) {}
+		static std::size_t const npos = ~static_cast<std::size_t>(0);
+		
+		rw_mutex m_mutex;
+		std::vector<Slot> m_slots; // Power of two
+		std::size_t m_count;
+		std::vector<std::vector<Timer>> m_wheel;
+		std::time_t m_wheelTime; // Last second handled
+		
+		// DO NOT LOCK!
+		std::size_t find(std::size_t hash, std::string const& key) const;
+		std::size_t locate(std::size_t hash, Session const* session) const;
+		bool insert(std::size_t hash, std::unique_ptr<Session>& session);
+		void erase(std::size_t index);
+		void schedule(Timer const& timer, std::time_t expiration);
+	};
+	
+	std::unique_ptr<Shard[]> m_shards;
+	std::size_t m_shardCount;
+	
+	// Keys deleted since the last Collect, when a SessionStore is kept
+	bool m_logDeletes;
+	std::mutex m_deletedMutex;
+	std::vector<std::string> m_deleted;
+	
+	Shard& shardOf(std::size_t hash);
 	
+public:
 	// Create a new Session Key.
 	static void CreateSessionKey(std::string&);
 	
-public:
-	// Remove all the expired sessions.
-	void CleanExpiredSessions();
+	SessionManager();
+	
+	// SessionShards, before the first request. With persist, deletions
+	// are recorded for Collect.
+	void Setup(int shards, bool persist);
+	
+	// SessionStore records of the sessions changed since the last call (of
+	// every session with all) and of the deleted ones, appended to out.
+	void Collect(std::string& out, bool all);
+	
+	// Loads the records written by Collect, the latest one of each session
+	// winning. Returns the number of live sessions restored.
+	std::size_t Restore(char const* data, std::size_t size);
+	
+	// Remove the sessions expired since the last call, a few at a time.
+	// Called every second.
+	void ExpireSessions();
 	
 	// Create a new empty session
 	Session* CreateSession(SessionDetectData const& sdd);
@@ -0,0 +1,142 @@
+#include "sessionstore.h"
+#include "session.h"
+#include "settings.h"
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+static char const g_magic[] = "LFSESS01";
+static std::size_t const g_magicSize = sizeof(g_magic) - 1;
+
+static std::mutex g_storeMutex; // The writer thread and Flush
+static std::string g_path;
+static int g_fd = -1;
+static bool g_rewrite = true; // Next pass writes every session
+static std::size_t g_fileSize = 0;
+static std::size_t g_liveSize = 0; // Size of the last full rewrite
+
+static bool WriteAll(int fd, std::string const& data)
+{
+	char const* p = data.data();
+	std::size_t left = data.size();
+	while(left > 0)
+	{
+		ssize_t n = write(fd, p, left);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		left -= static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+// Every live session into a new file, moved over the log once complete.
+static bool Rewrite()
+{
+	std::string data(g_magic, g_magicSize);
+	g_sessions.Collect(data, true);
+	
+	std::string const tmp = g_path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd < 0)
+	{
+		LogError("[SESSIONS] Unable to write " + tmp);
+		return false;
+	}
+	if(!WriteAll(fd, data) || fsync(fd) != 0 || rename(tmp.c_str(), g_path.c_str()) != 0)
+	{
+		LogError("[SESSIONS] Unable to write " + g_path);
+		close(fd);
+		unlink(tmp.c_str());
+		return false;
+	}
+	
+	// Still open on the renamed file, positioned at its end.
+	if(g_fd >= 0)
+		close(g_fd);
+	g_fd = fd;
+	g_fileSize = g_liveSize = data.size();
+	return true;
+}
+
+static bool Append()
+{
+	std::string data;
+	g_sessions.Collect(data, false);
+	if(data.empty())
+		return true;
+	if(!WriteAll(g_fd, data) || fdatasync(g_fd) != 0)
+	{
+		LogError("[SESSIONS] Unable to append to " + g_path);
+		return false;
+	}
+	g_fileSize += data.size();
+	return true;
+}
+
+static void Sync()
+{
+	std::lock_guard<std::mutex> lg(g_storeMutex);
+	// A failed append may have left a torn record: start over.
+	if(g_rewrite || g_fd < 0 || g_fileSize > 2 * g_liveSize + (1 << 20))
+		g_rewrite = !Rewrite();
+	else
+		g_rewrite = !Append();
+}
+
+static void RunStore()
+{
+	for(;;)
+	{
+		int interval;
+		{
+			SettingsScope ss;
+			interval = g_settings->m_sessionStoreInterval;
+		}
+		Sync();
+		std::this_thread::sleep_for(std::chrono::seconds(interval));
+	}
+}
+
+bool SessionStore::Restore(std::string const& path)
+{
+	g_path = path;
+	std::ifstream in(path, std::ios::binary);
+	if(!in)
+		return true; // Nothing saved yet
+	
+	std::string log((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if(log.size() < g_magicSize || log.compare(0, g_magicSize, g_magic) != 0)
+	{
+		LogError("[SESSIONS] " + path + " is not a session log, it will be overwritten.");
+		return false;
+	}
+	
+	std::size_t restored = g_sessions.Restore(log.data() + g_magicSize, log.size() - g_magicSize);
+	LogError("[SESSIONS] Restored " + std::to_string(restored) + " sessions from " + path);
+	return true;
+}
+
+void SessionStore::Start()
+{
+	if(g_path.empty())
+		return;
+	std::thread(RunStore).detach();
+}
+
+void SessionStore::Flush()
+{
+	if(g_path.empty())
+		return;
+	Sync();
+}
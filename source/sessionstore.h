@@ -0,0 +1,21 @@
+#ifndef SESSIONSTORE_H_INCLUDED
+#define SESSIONSTORE_H_INCLUDED
+#include <string>
+
+// Append-only log of g_sessions (SessionStore), so that sessions survive a
+// restart. Every SessionStoreInterval, the sessions changed since the last
+// pass are appended; once the log grows past twice its live size, it is
+// rewritten from scratch. Only this thread touches the file.
+class SessionStore {
+	SessionStore() =delete;
+public:
+	// Before accepting requests. False when the log couldn't be used.
+	static bool Restore(std::string const& path);
+	
+	static void Start();
+	
+	// Writes the pending changes now, on shutdown.
+	static void Flush();
+};
+
+#endif
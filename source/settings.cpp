@@ -4,28 +4,59 @@
 #include <stdexcept>
 #include <algorithm>
 #include <fstream>
+#include <atomic>
+#include <iterator>
 #include <iostream>
+#include <cstdlib>
+#include <fnmatch.h>
 
+// Lua side of the prelude, next to SetupLuaLibrary. Compiled once by LoadSettings.
 static std::string g_luaHeader = R"====(
-LUAFCGID=true
-LUAFCGID_VERSION=2
-lf={}
 function lf.serialize(a)local b=""if type(a)=="table"then local c={}for d,e in pairs(a)do if type(d)=="number"then d=tostring(d)elseif type(d)=="string"then d=string.format("[%q]",d)end;table.insert(c,string.format("%s = %s",d,lf.serialize(e)))end;b='{'..table.concat(c,",")..'}'elseif type(a)=="number"then b=tostring(a)elseif type(a)=="string"then b=string.format("%q",a)elseif type(a)=="boolean"then b=a and"true"or"false"end;return b end
-function lf.urlencode(a)if a and#a>0 then a=string.gsub(a,"([^%w ])",function(b)return string.format("%%%02X",string.byte(b))end)a=string.gsub(a," ","+")end;return a end
-function lf.urldecode(a)if a and#a>0 then a=string.gsub(a,"+"," ")a=string.gsub(a,"%%(%x%x)",function(b)return string.char(tonumber(b,16))end)end;return a end
-function lf.parse_pair(b)local c,d;if b and#b>0 then _,_,c,d=string.find(b,"([^=]*)=([^=]*)")if not d then d=""end end;return lf.urldecode(c),lf.urldecode(d)end
 function lf.parse(a)local b={}for c in string.gmatch(a,"[^&]*")do if c and#c>0 then local d,e=lf.parse_pair(c)if b[d]then if type(b[d])~="table"then b[d]={b[d]}end;table.insert(b[d],e)else b[d]=e end end end;return b end
 
-Response={
-[100]="100 Continue",[101]="101 Switching Protocols",[102]="102 Processing",[103]="103 Early Hints",
-[200]="200 OK",[201]="201 Created",[202]="202 Accepted",[203]="203 Non-Authoritative Information",[204]="204 No Content",[205]="205 Reset Content",[206]="206 Partial Content",[207]="207 Multi-Status",[208]="208 Already Reported",[226]="226 IM Used",
-[300]="300 Multiple Choices",[301]="301 Moved Permanently",[302]="302 Found",[303]="303 See Other",[304]="304 Not Modified",[305]="305 Use Proxy",[306]="306 Switch Proxy",[307]="307 Temporary Redirect",[308]="308 Permanent Redirect",
-[400]="400 Bad Request",[401]="401 Unauthorized",[402]="402 Payment Required",[403]="403 Forbidden",[404]="404 Not Found",[405]="405 Method Not Allowed",[406]="406 Not Acceptable",[407]="407 Proxy Authentication Required",[408]="408 Request Timeout",[409]="409 Conflict",[410]="410 Gone",[411]="411 Length Required",[412]="412 Precondition Failed",[413]="413 Payload Too Large",[414]="414 URI Too Long",[415]="415 Unsupported Media Type",
-[416]="416 Range Not Satisfiable",[417]="417 Expectation Failed",[418]="418 I'm a teapot",[421]="421 Misdirected Request",[422]="422 Unprocessable Entity",[423]="423 Locked",[424]="424 Failed Dependency",[426]="426 Upgrade Required",[428]="428 Precondition Required",[429]="429 Too Many Requests",[431]="431 Request Header Fields Too Large",[451]="451 Unavailable For Legal Reasons",
-[500]="500 Internal Server Error",[501]="501 Not Implemented",[502]="502 Bad Gateway",[503]="503 Service Unavailable",[504]="504 Gateway Timeout",[505]="505 HTTP Version Not Supported",[506]="506 Variant Also Negotiates",[507]="507 Insufficient Storage",[508]="508 Loop Detected",[510]="510 Not Extended",[511]="511 Network Authentication Required"
-}
+-- Record every Lua module found through package.path, so that the pool reloads when it changes,
+-- and load it from the compiled module cache shared by all of the states.
+do local t,u=__luafcgid_require,__luafcgid_compiled;__luafcgid_require=nil;__luafcgid_compiled=nil;local s=package.searchers or package.loaders;if t and s and package.searchpath then s[2]=function(a)local b,c=package.searchpath(a,package.path)if not b then return c end;local d,k=t(b)local f,e;if d then f,e=load(d,"@"..b)else f,e=loadfile(b)end;if not f then error(string.format("error loading module '%s' from file '%s':\n\t%s",a,b,e),2)end;if d and k>0 then u(b,k,string.dump(f))end;return f,b end end end
+
+-- Session values are kept natively as one binary string (checked by ValidValue in session.cpp).
+-- SetupLuaFunctions hands every request's Session table to __luafcgid_session.
+do local pack,unpack,mtype=string.pack,string.unpack,math.type
+local function enc(v,o,d)local t=type(v)if t=="boolean"then o[#o+1]=v and"\2"or"\1"elseif t=="number"then if mtype(v)=="integer"then if v>=-0x80000000 and v<0x80000000 then o[#o+1]=pack("<Bi4",3,v)else o[#o+1]=pack("<Bi8",4,v)end else o[#o+1]=pack("<Bd",5,v)end elseif t=="string"then if#v<256 then o[#o+1]=pack("<Bs1",6,v)else o[#o+1]=pack("<Bs4",7,v)end elseif t=="table"and d<32 then o[#o+1]="\8"for k,x in pairs(v)do if not enc(k,o,d+1)or not enc(x,o,d+1)then return false end end;o[#o+1]="\0"else return false end;return true end
+local function dec(s,i)local t=s:byte(i)i=i+1;if t==1 then return false,i elseif t==2 then return true,i elseif t==3 then return unpack("<i4",s,i)elseif t==4 then return unpack("<i8",s,i)elseif t==5 then return unpack("<d",s,i)elseif t==6 then return unpack("<s1",s,i)elseif t==7 then return unpack("<s4",s,i)end;local r,k,v={};while s:byte(i)~=0 do k,i=dec(s,i)v,i=dec(s,i)r[k]=v end;return r,i+1 end
+function __luafcgid_session(s)local set,get,gm,sm,gr=s.SetVar,s.GetVar,s.GetMany,s.SetMany,s.GetRealm
+s.SetVar=function(r,k,v)if v==nil then return set(r,k)end;local o={}if not enc(v,o,0)then return false end;return set(r,k,table.concat(o))end;s.GetVar=function(r,k)local b=get(r,k)if b then return(dec(b,1))end end
+s.GetMany=function(r,a)local o={}for i=1,#a do o[i]=pack("<s4",a[i])end;return(dec(gm(r,table.concat(o)),1))end;s.SetMany=function(r,t)local o={}if type(t)~="table"or not enc(t,o,0)then return false end;return sm(r,table.concat(o))end;s.GetRealm=function(r)return(dec(gr(r),1))end end end
 )====";
 
+// Lua source -> bytecode, so that every state doesn't parse it again.
+// what names the chunk in the errors.
+static bool CompileChunk(std::string const& source, char const* name, char const* what, std::string& bytecode)
+{
+	Lua::State compiler = Lua::State::create();
+	compiler.openlibs();
+	compiler.getglobal("string");
+	compiler.getfield(-1, "dump");
+	if(compiler.loadbuffer(source.c_str(), source.size(), name) != 0)
+	{
+		if(compiler.isstring(-1))
+			LogError(compiler.tostdstring(-1));
+		else
+			LogError(std::string("Error loading ") + what + ".");
+		compiler.close();
+		return false;
+	}
+	if(compiler.pcall(1, 1, 0) != 0)
+	{
+		LogError(std::string("Error compiling ") + what + ".");
+		compiler.close();
+		return false;
+	}
+	bytecode = compiler.tostdstring(-1);
+	compiler.close();
+	return true;
+}
+
 void BindBool(Lua::State& s, const char* variable, bool& def_val) {
 	if(s.getglobal(variable) == Lua::TP_BOOL) {
 		def_val = s.toboolean(-1);
@@ -47,19 +78,75 @@ void BindString(Lua::State& s, const char* variable, std::string& def_val) {
 	s.pop(1);
 }
 
+void BindFieldNumber(Lua::State& s, const char* field, int& def_val) {
+	if(s.getfield(-1, field) == Lua::TP_NUMBER) {
+		def_val = s.tonumber(-1);
+	}
+	s.pop(1);
+}
+
+void BindFieldString(Lua::State& s, const char* field, std::string& def_val) {
+	if(s.getfield(-1, field) == Lua::TP_STRING) {
+		def_val = s.tostdstring(-1);
+	}
+	s.pop(1);
+}
+
+static GCPolicy ParseGCPolicy(std::string const& name, GCPolicy def_val)
+{
+	if(name == "full")
+		return GCP_FULL;
+	if(name == "step")
+		return GCP_STEP;
+	if(name == "auto")
+		return GCP_AUTO;
+	return def_val;
+}
+
+static void ClampPoolRules(PoolRules& rules)
+{
+	if(rules.m_states < 1)
+		rules.m_states = 1;
+	if(rules.m_maxstates < rules.m_states)
+		rules.m_maxstates = rules.m_states;
+	if(rules.m_seek_retries < 1)
+		rules.m_seek_retries = 1;
+	if(rules.m_idleTime < 0)
+		rules.m_idleTime = 0;
+}
+
 Settings::Settings() :
 	m_threadCount(4),
 	m_states(3),
 	m_maxstates(5),
 	m_seek_retries(3),
+	m_globalMaxStates(0),
+	m_globalMaxMemory(0),
+	m_idleTime(0),
+	m_gcPolicy(GCP_FULL),
 	m_headersize(256),
 	m_bodysize(2048),
 	m_bodysectors(4),
 	m_fileInfoTime(5000),
 	m_useFileChecksum(true),
+	m_fingerprint(FP_SHA256),
+	m_useInotify(false),
+	m_pathCacheSize(4096),
+	m_moduleCacheSize(16384),
+	m_missingCacheSize(1024),
+	m_reservoirSize(4),
+	m_missingCacheTime(5000),
 	m_sessionName("XLuaSession"),
 	m_sessionTime(3600),
 	m_sessionKeyLen(24),
+	m_sessionShards(16),
+	m_sessionStore(),
+	m_sessionStoreInterval(10),
+	m_sessionMode(SM_SERVER),
+	m_sessionSecret(),
+	m_sharedSessionName("/luafcgid2-sessions"),
+	m_sharedSessionMemory(65536),
+	m_sharedSessionSlots(65536),
 	m_sessionCookieSecure(true),
 	m_sessionCookieHttpOnly(true),
 	m_sessionCookieSameSite(),
@@ -75,11 +162,19 @@ Settings::Settings() :
 	m_maxPostSize(1024 * 4096),
 	m_listen("/var/tmp/luafcgid2.sock"),
 	m_logFile("/var/log/luafcgid2/luafcgid2.log"),
-	m_luaEntrypoint("main")
+	m_luaEntrypoint("main"),
+	m_configGeneration(0),
+	m_luaState(Lua::State::create())
 {}
 
+// Every reload replaces the settings: their config state goes with them.
+Settings::~Settings()
+{
+	m_luaState.close();
+}
+
 
-void Settings::iPushValueTransfer(Lua::State& dest, int offset)
+void Settings::iPushValueTransfer(Lua::State& dest, int offset) const
 {
 	// Pop a value from m_luaState
 	// Push a value to dest
@@ -125,10 +220,9 @@ void Settings::iPushValueTransfer(Lua::State& dest, int offset)
 }
 
 // Setup Config.*
-std::mutex g_transferMutex;
-void Settings::TransferConfig(Lua::State& dest)
+void Settings::TransferConfig(Lua::State& dest) const
 {
-	std::lock_guard<std::mutex> g(g_transferMutex);
+	std::lock_guard<std::mutex> g(m_transferMutex);
 
 	m_luaState.getglobal("Config");
 	iPushValueTransfer(dest, -1);
@@ -136,36 +230,210 @@ void Settings::TransferConfig(Lua::State& dest)
 	m_luaState.pop(1);
 }
 
+// Per-state cache of LocalConfig tables, in the registry:
+// { [LC_GENERATION] = m_configGeneration, [LC_COUNT] = n, [domain] = table or false }
+static char const g_localConfigKey[] = "luafcgid.LocalConfig";
+enum {
+	LC_GENERATION = 1,
+	LC_COUNT = 2,
+	LC_MAX_DOMAINS = 64
+};
+
 // Setup LocalConfig.*
-void Settings::TransferLocalConfig(Lua::State& dest, std::string const& domain)
+// Copied once per state and domain, so that requests don't take m_transferMutex.
+void Settings::TransferLocalConfig(Lua::State& dest, std::string const& domain) const
 {
-	std::lock_guard<std::mutex> g(g_transferMutex);
-
-	m_luaState.getglobal("Config");
-	m_luaState.pushstdstring(domain);
-	m_luaState.rawget(-2);
-	iPushValueTransfer(dest, -1);
+	int count = 0;
+	bool fresh = dest.getfield(LUA_REGISTRYINDEX, g_localConfigKey) != Lua::TP_TABLE;
+	if(!fresh)
+	{
+		dest.pushinteger(LC_GENERATION);
+		dest.rawget(-2);
+		fresh = dest.tointeger(-1) != m_configGeneration;
+		dest.pop(1);
+		
+		dest.pushinteger(LC_COUNT);
+		dest.rawget(-2);
+		count = static_cast<int>(dest.tointeger(-1));
+		dest.pop(1);
+	}
+	if(fresh || count >= LC_MAX_DOMAINS)
+	{
+		dest.pop(1);
+		dest.newtable();
+		dest.pushinteger(LC_GENERATION);
+		dest.pushinteger(m_configGeneration);
+		dest.rawset(-3);
+		dest.pushvalue(-1);
+		dest.setfield(LUA_REGISTRYINDEX, g_localConfigKey);
+		count = 0;
+	}
+	
+	dest.pushstdstring(domain);
+	dest.rawget(-2);
+	if(dest.type(-1) == Lua::TP_NIL)
+	{
+		dest.pop(1);
+		{
+			std::lock_guard<std::mutex> g(m_transferMutex);
+			
+			m_luaState.getglobal("Config");
+			m_luaState.pushstdstring(domain);
+			m_luaState.rawget(-2);
+			iPushValueTransfer(dest, -1);
+			m_luaState.pop(2);
+		}
+		if(dest.type(-1) == Lua::TP_NIL)
+		{
+			dest.pop(1);
+			dest.pushboolean(false);
+		}
+		dest.pushstdstring(domain);
+		dest.pushvalue(-2);
+		dest.rawset(-4);
+		
+		dest.pushinteger(LC_COUNT);
+		dest.pushinteger(count + 1);
+		dest.rawset(-4);
+	}
+	if(dest.type(-1) == Lua::TP_BOOL)
+	{
+		dest.pop(1);
+		dest.pushnil();
+	}
 	dest.setglobal("LocalConfig");
-	m_luaState.pop(2);
+	dest.pop(1);
 }
 
 
+// Read ScriptRules = { { Match = "glob", States = n, ... }, ... }
+void Settings::iLoadScriptRules()
+{
+	std::map<int, std::pair<std::string, PoolRules>> ordered;
+	m_scriptRules.clear();
+	PoolRules defaults = ResolvePoolRules(std::string());
+	
+	if(m_luaState.getglobal("ScriptRules") == Lua::TP_TABLE)
+	{
+		m_luaState.pushnil();
+		while(m_luaState.next(-2) != 0)
+		{
+			if(m_luaState.isinteger(-2) && m_luaState.type(-1) == Lua::TP_TABLE)
+			{
+				std::string pattern;
+				std::string gcPolicy;
+				PoolRules rules = defaults;
+				BindFieldString(m_luaState, "Match", pattern);
+				BindFieldNumber(m_luaState, "States", rules.m_states);
+				BindFieldNumber(m_luaState, "MaxStates", rules.m_maxstates);
+				BindFieldNumber(m_luaState, "SearchRetries", rules.m_seek_retries);
+				BindFieldString(m_luaState, "GCPolicy", gcPolicy);
+				BindFieldNumber(m_luaState, "IdleTime", rules.m_idleTime);
+				rules.m_gcPolicy = ParseGCPolicy(gcPolicy, rules.m_gcPolicy);
+				ClampPoolRules(rules);
+				
+				if(pattern.empty())
+					LogError("ScriptRules: ignoring a rule without Match.");
+				else
+					ordered[static_cast<int>(m_luaState.tointeger(-2))] = std::make_pair(pattern, rules);
+			}
+			m_luaState.pop(1);
+		}
+	}
+	m_luaState.pop(1);
+	
+	for(auto it = ordered.begin(); it != ordered.end(); ++it)
+		m_scriptRules.push_back(it->second);
+}
+
+PoolRules Settings::ResolvePoolRules(std::string const& script) const
+{
+	for(auto it = m_scriptRules.begin(); it != m_scriptRules.end(); ++it)
+	{
+		if(fnmatch(it->first.c_str(), script.c_str(), 0) == 0)
+			return it->second;
+	}
+	
+	PoolRules rules;
+	rules.m_states = m_states;
+	rules.m_maxstates = m_maxstates;
+	rules.m_seek_retries = m_seek_retries;
+	rules.m_gcPolicy = m_gcPolicy;
+	rules.m_idleTime = m_idleTime;
+	ClampPoolRules(rules);
+	return rules;
+}
+
 bool Settings::LoadSettings(std::string const& path)
 {
-	m_luaState = Lua::State::create();
-	if(m_luaState.loadfile(path.c_str()) == LUA_OK && m_luaState.pcall() == LUA_OK) {
+	// An empty path keeps the defaults; a config that doesn't load or run
+	// is refused, so a broken edit never replaces the settings in use.
+	if(!path.empty())
+	{
+		if(m_luaState.loadfile(path.c_str()) != LUA_OK || m_luaState.pcall() != LUA_OK)
+		{
+			if(m_luaState.isstring(-1))
+				LogError(m_luaState.tostdstring(-1));
+			else
+				LogError("Error loading " + path + ".");
+			m_luaState.pop(1);
+			return false;
+		}
 		BindNumber(m_luaState, "WorkerThreads", m_threadCount);
 		BindNumber(m_luaState, "LuaStates", m_states);
 		BindNumber(m_luaState, "LuaMaxStates", m_maxstates);
 		BindNumber(m_luaState, "LuaMaxSearchRetries", m_seek_retries);
+		BindNumber(m_luaState, "LuaGlobalMaxStates", m_globalMaxStates);
+		BindNumber(m_luaState, "LuaGlobalMaxMemory", m_globalMaxMemory);
+		BindNumber(m_luaState, "LuaStateIdleTime", m_idleTime);
+		{
+			std::string gcPolicy;
+			BindString(m_luaState, "LuaGCPolicy", gcPolicy);
+			m_gcPolicy = ParseGCPolicy(gcPolicy, m_gcPolicy);
+		}
 		BindNumber(m_luaState, "HeadersSize", m_headersize);
 		BindNumber(m_luaState, "BodySize", m_bodysize);
 		BindNumber(m_luaState, "BodySectors", m_bodysectors);
 		BindNumber(m_luaState, "MinFileInfoTime", m_fileInfoTime);
 		BindBool  (m_luaState, "UseFileChecksum", m_useFileChecksum);
+		BindBool  (m_luaState, "UseInotify", m_useInotify);
+		{
+			std::string fingerprint;
+			BindString(m_luaState, "FileFingerprint", fingerprint);
+			if(fingerprint == "stat")
+				m_fingerprint = FP_STAT;
+			else if(fingerprint == "hash")
+				m_fingerprint = FP_HASH;
+			else if(fingerprint == "sha256")
+				m_fingerprint = FP_SHA256;
+			else
+				m_fingerprint = m_useFileChecksum ? FP_SHA256 : FP_STAT;
+		}
+		BindNumber(m_luaState, "PathCacheSize", m_pathCacheSize);
+		BindNumber(m_luaState, "ModuleCacheSize", m_moduleCacheSize);
+		BindNumber(m_luaState, "MissingScriptCacheSize", m_missingCacheSize);
+		BindNumber(m_luaState, "StateReservoirSize", m_reservoirSize);
+		BindNumber(m_luaState, "MissingScriptCacheTime", m_missingCacheTime);
 		BindString(m_luaState, "SessionName", m_sessionName);
 		BindNumber(m_luaState, "SessionTime", m_sessionTime);
 		BindNumber(m_luaState, "SessionKeyLen", m_sessionKeyLen);
+		BindNumber(m_luaState, "SessionShards", m_sessionShards);
+		BindString(m_luaState, "SessionStore", m_sessionStore);
+		BindNumber(m_luaState, "SessionStoreInterval", m_sessionStoreInterval);
+		{
+			std::string mode;
+			BindString(m_luaState, "SessionMode", mode);
+			if(mode == "cookie")
+				m_sessionMode = SM_COOKIE;
+			else if(mode == "shared")
+				m_sessionMode = SM_SHARED;
+			else if(mode == "server")
+				m_sessionMode = SM_SERVER;
+		}
+		BindString(m_luaState, "SessionSecret", m_sessionSecret);
+		BindString(m_luaState, "SharedSessionName", m_sharedSessionName);
+		BindNumber(m_luaState, "SharedSessionMemory", m_sharedSessionMemory);
+		BindNumber(m_luaState, "SharedSessionSlots", m_sharedSessionSlots);
 		BindBool  (m_luaState, "SessionCookieSecure", m_sessionCookieSecure);
 		BindBool  (m_luaState, "SessionCookieHttpOnly", m_sessionCookieHttpOnly);
 		BindString(m_luaState, "SessionCookieSameSite", m_sessionCookieSameSite);
@@ -191,6 +459,32 @@ bool Settings::LoadSettings(std::string const& path)
 		m_maxstates = 1;
 	if(m_seek_retries < 1)
 		m_seek_retries = 1;
+	if(m_globalMaxStates < 0)
+		m_globalMaxStates = 0;
+	if(m_globalMaxMemory < 0)
+		m_globalMaxMemory = 0;
+	if(m_idleTime < 0)
+		m_idleTime = 0;
+	if(m_pathCacheSize < 0)
+		m_pathCacheSize = 0;
+	if(m_moduleCacheSize < 0)
+		m_moduleCacheSize = 0;
+	if(m_missingCacheSize < 0)
+		m_missingCacheSize = 0;
+	if(m_reservoirSize < 0)
+		m_reservoirSize = 0;
+	if(m_sessionShards < 1)
+		m_sessionShards = 1;
+	if(m_sessionStoreInterval < 1)
+		m_sessionStoreInterval = 1;
+	if(m_sharedSessionMemory < 64)
+		m_sharedSessionMemory = 64;
+	if(m_sharedSessionSlots < 64)
+		m_sharedSessionSlots = 64;
+	if(m_missingCacheTime < 0)
+		m_missingCacheTime = 0;
+	
+	iLoadScriptRules();
 	if(m_headersize < 0)
 		m_headersize = 0;
 	if(m_bodysize < 0)
@@ -200,22 +494,17 @@ bool Settings::LoadSettings(std::string const& path)
 	if(m_maxPostSize < 0)
 		m_maxPostSize = 0;
 
+	if(!CompileChunk(g_luaHeader, "prelude", "the prelude", m_luaPrelude))
+		return false;
+	m_luaStartup.clear();
+	if(!m_luaHeader.empty())
 	{
-		m_luaLoadData = g_luaHeader;
-		if(!m_luaHeader.empty())
+		std::ifstream myScript(m_luaHeader, std::ios::binary);
+		if(myScript)
 		{
-			std::ifstream myScript(m_luaHeader, std::ios::ate | std::ios::binary);
-			if(myScript)
-			{
-				std::streamsize size = myScript.tellg();
-				if(size > 0)
-				{
-					m_luaLoadData.resize(size + g_luaHeader.size());
-					myScript.seekg(0, std::ios::beg);
-					if(!myScript.read(&(m_luaLoadData[g_luaHeader.size()]), size))
-						m_luaLoadData = g_luaHeader;
-				}
-			}
+			std::string source((std::istreambuf_iterator<char>(myScript)), std::istreambuf_iterator<char>());
+			if(!source.empty() && !CompileChunk(source, "head", "Startup Script file", m_luaStartup))
+				return false;
 		}
 	}
 
@@ -234,7 +523,49 @@ void LogError(char const* s)
 	std::cerr << s << std::endl;
 }
 
-Settings g_settings;
+static std::shared_ptr<Settings const> g_current;
+static std::atomic<Settings const*> g_currentRaw(nullptr);
+static thread_local Settings const* t_pinned = nullptr;
+static thread_local bool t_publisher = false;
+
+std::shared_ptr<Settings const> Settings::Current()
+{
+	return std::atomic_load(&g_current);
+}
+
+void Settings::Publish(std::shared_ptr<Settings> settings)
+{
+	t_publisher = true;
+	std::shared_ptr<Settings const> previous = Current();
+	settings->m_configGeneration = previous ? previous->m_configGeneration + 1 : 1;
+	g_currentRaw.store(settings.get(), std::memory_order_release);
+	std::atomic_store(&g_current, std::shared_ptr<Settings const>(std::move(settings)));
+}
+
+SettingsScope::SettingsScope() : m_settings(Settings::Current()), m_previous(t_pinned)
+{
+	t_pinned = m_settings.get();
+}
+
+SettingsScope::~SettingsScope()
+{
+	t_pinned = m_previous;
+}
+
+Settings const* SettingsRef::operator->() const
+{
+	if(t_pinned)
+		return t_pinned;
+	// Anywhere else, the next Publish could free them while in use.
+	if(!t_publisher)
+	{
+		LogError("[PARENT] Settings read outside of a SettingsScope.");
+		std::abort();
+	}
+	return g_currentRaw.load(std::memory_order_acquire);
+}
+
+SettingsRef g_settings;
 std::mutex g_errormutex;
 
 static std::mutex g_gmtime_mx;
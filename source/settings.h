@@ -4,25 +4,75 @@
 #include <string>
 #include <vector>
 #include <mutex>
+#include <memory>
 #include <ctime>
 #include "state.h"
 
+enum GCPolicy {
+	GCP_FULL, // Full collection after every request
+	GCP_STEP, // Single incremental step after every request
+	GCP_AUTO  // Leave it to Lua's own collector
+};
+
+enum FingerprintMode {
+	FP_STAT,  // Device, inode, mtime and size
+	FP_HASH,  // 64-bit non-cryptographic hash of the contents
+	FP_SHA256 // SHA-256 of the contents
+};
+
+enum SessionMode {
+	SM_SERVER, // Kept in g_sessions, the cookie only holds the key
+	SM_COOKIE, // Kept in a signed cookie (SignedCookie)
+	SM_SHARED  // Kept in shared memory, for every process of the host (SharedSessions)
+};
+
+// Pool sizing for a single script, resolved once when its pool is created.
+struct PoolRules {
+	int m_states;
+	int m_maxstates;
+	int m_seek_retries;
+	GCPolicy m_gcPolicy;
+	int m_idleTime; // Seconds, 0 = never unload idle states
+};
+
 class Settings {
 public:
 	int m_threadCount;
 	int m_states;
 	int m_maxstates;
 	int m_seek_retries;
+	int m_globalMaxStates;
+	int m_globalMaxMemory;
+	int m_idleTime;
+	GCPolicy m_gcPolicy;
+
+	// Glob pattern -> rules, first match wins
+	std::vector<std::pair<std::string, PoolRules>> m_scriptRules;
 	int m_headersize;
 	int m_bodysize;
 	int m_bodysectors;
 
 	int m_fileInfoTime;
 	bool m_useFileChecksum;
+	FingerprintMode m_fingerprint;
+	bool m_useInotify;
+	int m_pathCacheSize;
+	int m_moduleCacheSize; // KB
+	int m_missingCacheSize;
+	int m_reservoirSize;
+	int m_missingCacheTime; // ms
 
 	std::string m_sessionName;
 	int m_sessionTime;
 	int m_sessionKeyLen;
+	int m_sessionShards;
+	std::string m_sessionStore;
+	int m_sessionStoreInterval; // s
+	SessionMode m_sessionMode;
+	std::string m_sessionSecret;
+	std::string m_sharedSessionName;
+	int m_sharedSessionMemory; // KB
+	int m_sharedSessionSlots;
 	bool m_sessionCookieSecure;
 	bool m_sessionCookieHttpOnly;
 	std::string m_sessionCookieSameSite;
@@ -42,19 +92,49 @@ public:
 	std::string m_luaHeader;
 	std::string m_luaEntrypoint;
 
-	std::string m_luaLoadData;
+	int m_configGeneration; // Bumped by every LoadSettings
+	std::string m_luaPrelude; // Bytecode
+	std::string m_luaStartup; // Bytecode of StartupScript, may be empty
 
-	Lua::State m_luaState;
+	// Only used by LoadSettings and, under m_transferMutex, the Transfer functions.
+	mutable Lua::State m_luaState;
+	mutable std::mutex m_transferMutex;
 
-	void iPushValueTransfer(Lua::State& dest, int offset);
+	void iPushValueTransfer(Lua::State& dest, int offset) const;
+	void iLoadScriptRules();
 public:
 	Settings();
+	~Settings();
 	bool LoadSettings(std::string const& path);
-	void TransferConfig(Lua::State& dest);
-	void TransferLocalConfig(Lua::State& dest, std::string const& domain);
+	PoolRules ResolvePoolRules(std::string const& script) const;
+	void TransferConfig(Lua::State& dest) const;
+	void TransferLocalConfig(Lua::State& dest, std::string const& domain) const;
+	
+	// Published settings are immutable. Publish gives them the next
+	// m_configGeneration; threads see them from their next SettingsScope.
+	static std::shared_ptr<Settings const> Current();
+	static void Publish(std::shared_ptr<Settings> settings);
+};
+
+// Pins the current settings for this thread while alive: a request,
+// a scanner pass... so that a reload never changes them halfway.
+class SettingsScope {
+	std::shared_ptr<Settings const> const m_settings;
+	Settings const* const m_previous;
+	SettingsScope(SettingsScope const&) =delete;
+	SettingsScope& operator= (SettingsScope const&) =delete;
+public:
+	SettingsScope();
+	~SettingsScope();
+};
+
+// The settings pinned by this thread. Outside of any SettingsScope, only the
+// thread that Publishes (main) may use it: anywhere else, it aborts.
+struct SettingsRef {
+	Settings const* operator->() const;
 };
 
-extern Settings g_settings;
+extern SettingsRef g_settings;
 extern std::mutex g_errormutex;
 
 void LogError(std::string const&);
@@ -0,0 +1,447 @@
+#include "shmstore.h"
+#include "settings.h"
+#include "rcu.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	std::uint32_t const NONE = ~0u;
+	enum {
+		STRIPES = 64,
+		KEY_SIZE = 64,
+		MIN_BLOCK = 64, // Heap blocks are MIN_BLOCK << class bytes
+		CLASSES = 26
+	};
+	char const g_magic[8] = {'L', 'F', 'S', 'H', 'M', '0', '0', '2'};
+	
+	struct Header {
+		char m_magic[8];
+		std::uint32_t m_stripes;
+		std::uint32_t m_slots; // Per stripe, power of two
+		std::uint64_t m_heap; // Bytes per stripe
+		std::uint64_t m_stripeSize;
+		std::atomic<std::uint32_t> m_ready; // Set once initialized
+	};
+	
+	struct Slot {
+		std::uint64_t m_hash; // 0 when free
+		std::int64_t m_expiration;
+		std::uint32_t m_offset; // In the stripe's heap, or NONE
+		std::uint32_t m_size;
+		std::uint8_t m_class;
+		std::uint8_t m_keyLen;
+		char m_key[KEY_SIZE];
+	};
+	
+	// Followed by its slots, then its heap.
+	struct Stripe {
+		pthread_mutex_t m_mutex;
+		std::uint32_t m_count;
+		std::uint32_t m_top; // Heap bytes handed out since the stripe was last empty
+		std::uint32_t m_free[CLASSES]; // Freed blocks of each class, linked through their first 4 bytes
+	};
+}
+
+static Header* g_header = nullptr;
+
+static inline std::size_t Align(std::size_t size)
+{
+	return (size + 63) & ~static_cast<std::size_t>(63);
+}
+
+static Stripe& StripeAt(std::uint32_t i)
+{
+	char* base = reinterpret_cast<char*>(g_header) + Align(sizeof(Header));
+	return *reinterpret_cast<Stripe*>(base + i * g_header->m_stripeSize);
+}
+
+static Slot* SlotsOf(Stripe& stripe)
+{
+	return reinterpret_cast<Slot*>(reinterpret_cast<char*>(&stripe) + Align(sizeof(Stripe)));
+}
+
+static char* HeapOf(Stripe& stripe)
+{
+	return reinterpret_cast<char*>(SlotsOf(stripe)) + Align(sizeof(Slot) * g_header->m_slots);
+}
+
+static void ResetHeap(Stripe& stripe)
+{
+	stripe.m_top = 0;
+	for(int c = 0; c < CLASSES; ++c)
+		stripe.m_free[c] = NONE;
+}
+
+static void ResetStripe(Stripe& stripe)
+{
+	stripe.m_count = 0;
+	ResetHeap(stripe);
+	std::memset(SlotsOf(stripe), 0, sizeof(Slot) * g_header->m_slots);
+}
+
+// Holds a stripe's mutex. When its last owner died holding it, the stripe
+// may be half updated: it is emptied rather than trusted. When the mutex
+// can't be taken at all, Locked() is false and the stripe is left alone.
+class StripeLock {
+	Stripe& m_stripe;
+	bool m_locked;
+	StripeLock(StripeLock const&) =delete;
+	StripeLock& operator= (StripeLock const&) =delete;
+public:
+	explicit StripeLock(Stripe& stripe) : m_stripe(stripe), m_locked(false) {
+		int const result = pthread_mutex_lock(&m_stripe.m_mutex);
+		if(result == 0)
+			m_locked = true;
+		else if(result == EOWNERDEAD)
+		{
+			LogError("[SESSIONS] A process died while updating shared sessions, dropping a stripe.");
+			ResetStripe(m_stripe);
+			pthread_mutex_consistent(&m_stripe.m_mutex);
+			m_locked = true;
+		}
+		else if(result == ENOTRECOVERABLE)
+			LogError("[SESSIONS] A shared session stripe can't be recovered, remove the segment from /dev/shm.");
+		else
+			LogError("[SESSIONS] Unable to lock a shared session stripe: " + std::string(std::strerror(result)));
+	}
+	~StripeLock() {
+		if(m_locked)
+			pthread_mutex_unlock(&m_stripe.m_mutex);
+	}
+	bool Locked() const { return m_locked; }
+};
+
+// The low bit only marks the slot as used, it takes no part in the home
+// slot: otherwise every home would be odd.
+static std::uint64_t KeyHash(std::string const& key)
+{
+	return static_cast<std::uint64_t>(HashBytes(key.data(), key.size())) | 1;
+}
+
+static std::uint32_t HomeOf(std::uint64_t hash)
+{
+	return static_cast<std::uint32_t>(hash >> 1) & (g_header->m_slots - 1);
+}
+
+// FNV-1a barely mixes the last bytes into the high bits: stir them first.
+static Stripe& StripeOf(std::uint64_t hash)
+{
+	return StripeAt(static_cast<std::uint32_t>(((hash * 0x9E3779B97F4A7C15ULL) >> 32) % g_header->m_stripes));
+}
+
+static std::uint32_t Find(Stripe& stripe, std::uint64_t hash, std::string const& key)
+{
+	Slot* slots = SlotsOf(stripe);
+	std::uint32_t const mask = g_header->m_slots - 1;
+	for(std::uint32_t i = HomeOf(hash);; i = (i + 1) & mask)
+	{
+		Slot const& slot = slots[i];
+		if(slot.m_hash == 0)
+			return NONE;
+		if(slot.m_hash == hash && slot.m_keyLen == key.size()
+			&& std::memcmp(slot.m_key, key.data(), key.size()) == 0)
+			return i;
+	}
+}
+
+static void Push(Stripe& stripe, std::uint8_t cls, std::uint32_t offset)
+{
+	std::memcpy(HeapOf(stripe) + offset, &stripe.m_free[cls], sizeof(std::uint32_t));
+	stripe.m_free[cls] = offset;
+}
+
+static std::uint32_t Pop(Stripe& stripe, std::uint8_t cls)
+{
+	std::uint32_t const offset = stripe.m_free[cls];
+	if(offset != NONE)
+		std::memcpy(&stripe.m_free[cls], HeapOf(stripe) + offset, sizeof(std::uint32_t));
+	return offset;
+}
+
+// A freed block of the class, else fresh heap, else a larger freed block
+// split in halves down to the class, the other halves going to the free
+// lists below it.
+static std::uint32_t Allocate(Stripe& stripe, std::size_t size, std::uint8_t& cls)
+{
+	cls = 0;
+	while(cls < CLASSES && (static_cast<std::size_t>(MIN_BLOCK) << cls) < size)
+		++cls;
+	if(cls == CLASSES)
+		return NONE;
+	
+	std::uint32_t offset = Pop(stripe, cls);
+	if(offset != NONE)
+		return offset;
+	std::uint64_t const block = static_cast<std::uint64_t>(MIN_BLOCK) << cls;
+	if(stripe.m_top + block <= g_header->m_heap)
+	{
+		offset = stripe.m_top;
+		stripe.m_top += static_cast<std::uint32_t>(block);
+		return offset;
+	}
+	for(std::uint8_t larger = cls + 1; larger < CLASSES; ++larger)
+	{
+		offset = Pop(stripe, larger);
+		if(offset == NONE)
+			continue;
+		while(larger > cls)
+		{
+			--larger;
+			Push(stripe, larger, offset + (static_cast<std::uint32_t>(MIN_BLOCK) << larger));
+		}
+		return offset;
+	}
+	return NONE;
+}
+
+static void Release(Stripe& stripe, Slot const& slot)
+{
+	if(slot.m_offset != NONE)
+		Push(stripe, slot.m_class, slot.m_offset);
+}
+
+// Backward shift deletion, as in SessionManager::Shard::erase.
+static void Erase(Stripe& stripe, std::uint32_t index)
+{
+	Slot* slots = SlotsOf(stripe);
+	std::uint32_t const mask = g_header->m_slots - 1;
+	Release(stripe, slots[index]);
+	slots[index].m_hash = 0;
+	// Nothing left to shift, and every block is free: the heap starts over
+	// rather than stay split up.
+	if(--stripe.m_count == 0)
+	{
+		ResetHeap(stripe);
+		return;
+	}
+	
+	std::uint32_t hole = index;
+	for(std::uint32_t i = (index + 1) & mask; slots[i].m_hash != 0; i = (i + 1) & mask)
+	{
+		std::uint32_t const home = HomeOf(slots[i].m_hash);
+		if(((i - home) & mask) >= ((i - hole) & mask))
+		{
+			slots[hole] = slots[i];
+			slots[i].m_hash = 0;
+			hole = i;
+		}
+	}
+}
+
+static bool Initialize(std::uint32_t slots, std::uint64_t heap)
+{
+	g_header->m_stripes = STRIPES;
+	g_header->m_slots = slots;
+	g_header->m_heap = heap;
+	g_header->m_stripeSize = Align(sizeof(Stripe)) + Align(sizeof(Slot) * slots) + Align(heap);
+	
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	bool ok = true;
+	for(std::uint32_t i = 0; i < STRIPES && ok; ++i)
+	{
+		Stripe& stripe = StripeAt(i);
+		ok = pthread_mutex_init(&stripe.m_mutex, &attr) == 0;
+		ResetStripe(stripe);
+	}
+	pthread_mutexattr_destroy(&attr);
+	
+	std::memcpy(g_header->m_magic, g_magic, sizeof(g_magic));
+	g_header->m_ready.store(ok ? 1 : 0, std::memory_order_release);
+	return ok;
+}
+
+bool SharedSessions::Open(std::string const& name, int memoryKB, int slots)
+{
+	if(g_settings->m_sessionKeyLen > KEY_SIZE)
+	{
+		LogError("[SESSIONS] Shared sessions only hold keys of up to 64 bytes, lower SessionKeyLen.");
+		return false;
+	}
+	
+	std::uint32_t perStripe = 16;
+	while(perStripe * STRIPES < static_cast<std::uint32_t>(slots) && perStripe < (1u << 24))
+		perStripe *= 2;
+	std::uint64_t const heap = Align(static_cast<std::uint64_t>(memoryKB) * 1024 / STRIPES);
+	std::size_t const size = Align(sizeof(Header))
+		+ STRIPES * (Align(sizeof(Stripe)) + Align(sizeof(Slot) * perStripe) + heap);
+	
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	bool const creator = fd >= 0;
+	if(!creator && errno == EEXIST)
+		fd = shm_open(name.c_str(), O_RDWR, 0600);
+	if(fd < 0)
+	{
+		LogError("[SESSIONS] Unable to open the shared memory segment " + name);
+		return false;
+	}
+	
+	if(creator)
+	{
+		if(ftruncate(fd, static_cast<off_t>(size)) != 0)
+		{
+			LogError("[SESSIONS] Unable to size the shared memory segment " + name);
+			close(fd);
+			shm_unlink(name.c_str());
+			return false;
+		}
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(p == MAP_FAILED)
+		{
+			LogError("[SESSIONS] Unable to map the shared memory segment " + name);
+			return false;
+		}
+		g_header = static_cast<Header*>(p);
+		return Initialize(perStripe, heap);
+	}
+	
+	// Another process created it: wait for it to be initialized, and use
+	// its geometry whatever ours is.
+	struct stat st;
+	for(int i = 0; i < 50; ++i)
+	{
+		if(fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(Header))
+		{
+			void* p = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(p != MAP_FAILED)
+			{
+				Header* header = static_cast<Header*>(p);
+				if(header->m_ready.load(std::memory_order_acquire)
+					&& std::memcmp(header->m_magic, g_magic, sizeof(g_magic)) == 0)
+				{
+					close(fd);
+					g_header = header;
+					return true;
+				}
+				munmap(p, static_cast<std::size_t>(st.st_size));
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	close(fd);
+	LogError("[SESSIONS] The shared memory segment " + name + " was never initialized, remove it from /dev/shm.");
+	return false;
+}
+
+bool SharedSessions::Load(std::string const& key, std::string& payload, std::int64_t& expiration)
+{
+	if(!g_header || key.size() > KEY_SIZE)
+		return false;
+	std::uint64_t const hash = KeyHash(key);
+	Stripe& stripe = StripeOf(hash);
+	StripeLock lock(stripe);
+	if(!lock.Locked())
+		return false;
+	
+	std::uint32_t i = Find(stripe, hash, key);
+	if(i == NONE)
+		return false;
+	Slot const& slot = SlotsOf(stripe)[i];
+	if(slot.m_expiration < static_cast<std::int64_t>(std::time(nullptr)))
+	{
+		Erase(stripe, i);
+		return false;
+	}
+	expiration = slot.m_expiration;
+	if(slot.m_offset == NONE)
+		payload.clear();
+	else
+		payload.assign(HeapOf(stripe) + slot.m_offset, slot.m_size);
+	return true;
+}
+
+bool SharedSessions::Store(std::string const& key, std::int64_t expiration, std::string const& payload)
+{
+	if(!g_header || key.size() > KEY_SIZE)
+		return false;
+	std::uint64_t const hash = KeyHash(key);
+	Stripe& stripe = StripeOf(hash);
+	StripeLock lock(stripe);
+	if(!lock.Locked())
+		return false;
+	Slot* slots = SlotsOf(stripe);
+	
+	std::uint32_t i = Find(stripe, hash, key);
+	if(i == NONE && (stripe.m_count + 1) * 4 > g_header->m_slots * 3)
+		return false;
+	
+	// The new copy is complete before the slot points to it.
+	std::uint8_t cls = 0;
+	std::uint32_t offset = NONE;
+	if(!payload.empty())
+	{
+		offset = Allocate(stripe, payload.size(), cls);
+		if(offset == NONE)
+			return false;
+		std::memcpy(HeapOf(stripe) + offset, payload.data(), payload.size());
+	}
+	
+	if(i == NONE)
+	{
+		std::uint32_t const mask = g_header->m_slots - 1;
+		for(i = HomeOf(hash); slots[i].m_hash != 0; i = (i + 1) & mask) {}
+		std::memcpy(slots[i].m_key, key.data(), key.size());
+		slots[i].m_keyLen = static_cast<std::uint8_t>(key.size());
+		slots[i].m_hash = hash;
+		++stripe.m_count;
+	}
+	else
+		Release(stripe, slots[i]);
+	slots[i].m_expiration = expiration;
+	slots[i].m_offset = offset;
+	slots[i].m_size = static_cast<std::uint32_t>(payload.size());
+	slots[i].m_class = cls;
+	return true;
+}
+
+void SharedSessions::Remove(std::string const& key)
+{
+	if(!g_header || key.size() > KEY_SIZE)
+		return;
+	std::uint64_t const hash = KeyHash(key);
+	Stripe& stripe = StripeOf(hash);
+	StripeLock lock(stripe);
+	if(!lock.Locked())
+		return;
+	std::uint32_t i = Find(stripe, hash, key);
+	if(i != NONE)
+		Erase(stripe, i);
+}
+
+void SharedSessions::Expire()
+{
+	static std::uint32_t s_next = 0; // Main thread only
+	if(!g_header)
+		return;
+	std::int64_t const now = static_cast<std::int64_t>(std::time(nullptr));
+	for(int n = 0; n < 4; ++n)
+	{
+		Stripe& stripe = StripeAt(s_next);
+		s_next = (s_next + 1) % g_header->m_stripes;
+		
+		StripeLock lock(stripe);
+		if(!lock.Locked())
+			continue;
+		Slot* slots = SlotsOf(stripe);
+		for(std::uint32_t i = 0; i < g_header->m_slots; )
+		{
+			// Erase may shift another entry into i.
+			if(slots[i].m_hash != 0 && slots[i].m_expiration < now)
+				Erase(stripe, i);
+			else
+				++i;
+		}
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef SHMSTORE_H_INCLUDED
+#define SHMSTORE_H_INCLUDED
+#include <string>
+#include <cstdint>
+
+// Sessions shared by every luafcgid2 process of the host (SessionMode =
+// "shared"), in a POSIX shared memory segment. The table is split into
+// stripes, each with its own robust process-shared mutex, slots and heap
+// addressed by offsets, so that the sessions outlive any single process.
+class SharedSessions {
+	SharedSessions() =delete;
+public:
+	// Creates the segment, or maps the one another process created.
+	static bool Open(std::string const& name, int memoryKB, int slots);
+	
+	// Copies out the payload of a live session.
+	static bool Load(std::string const& key, std::string& payload, std::int64_t& expiration);
+	
+	// Inserts or replaces. False when its stripe is out of slots or memory.
+	static bool Store(std::string const& key, std::int64_t expiration, std::string const& payload);
+	
+	static void Remove(std::string const& key);
+	
+	// Drops the expired sessions of a few stripes. Called every second.
+	static void Expire();
+};
+
+#endif
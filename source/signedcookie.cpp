@@ -0,0 +1,151 @@
+#include "signedcookie.h"
+#include "settings.h"
+#include "csprng.h"
+#include <picosha2.h>
+#include <array>
+#include <cstdint>
+
+typedef std::array<unsigned char, 32> digest_t;
+
+static char const g_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Without a SessionSecret, cookies only verify within this process.
+static std::string const& ProcessSecret()
+{
+	static std::string const secret = []() {
+		std::string s(32, '\0');
+		SecureRandom::Fill(&s[0], s.size());
+		return s;
+	}();
+	return secret;
+}
+
+static digest_t Hmac(std::string const& secret, std::string const& message)
+{
+	unsigned char key[64] = {};
+	if(secret.size() > sizeof(key))
+		picosha2::hash256(secret.begin(), secret.end(), key, key + 32);
+	else
+		std::copy(secret.begin(), secret.end(), key);
+	
+	unsigned char pad[64];
+	for(int i = 0; i < 64; ++i)
+		pad[i] = key[i] ^ 0x36;
+	picosha2::hash256_one_by_one inner;
+	inner.process(pad, pad + 64);
+	inner.process(message.begin(), message.end());
+	inner.finish();
+	digest_t innerDigest;
+	inner.get_hash_bytes(innerDigest.begin(), innerDigest.end());
+	
+	for(int i = 0; i < 64; ++i)
+		pad[i] = key[i] ^ 0x5c;
+	picosha2::hash256_one_by_one outer;
+	outer.process(pad, pad + 64);
+	outer.process(innerDigest.begin(), innerDigest.end());
+	outer.finish();
+	digest_t digest;
+	outer.get_hash_bytes(digest.begin(), digest.end());
+	return digest;
+}
+
+static digest_t Sign(std::string const& payload)
+{
+	std::string const& secret = g_settings->m_sessionSecret;
+	return Hmac(secret.empty() ? ProcessSecret() : secret, payload);
+}
+
+// Unpadded
+static void Base64Encode(std::string& out, unsigned char const* data, std::size_t size)
+{
+	std::size_t i = 0;
+	for(; i + 3 <= size; i += 3)
+	{
+		std::uint32_t const v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		out += g_base64[(v >> 18) & 63];
+		out += g_base64[(v >> 12) & 63];
+		out += g_base64[(v >> 6) & 63];
+		out += g_base64[v & 63];
+	}
+	if(size - i == 1)
+	{
+		std::uint32_t const v = data[i] << 16;
+		out += g_base64[(v >> 18) & 63];
+		out += g_base64[(v >> 12) & 63];
+	}
+	else if(size - i == 2)
+	{
+		std::uint32_t const v = (data[i] << 16) | (data[i + 1] << 8);
+		out += g_base64[(v >> 18) & 63];
+		out += g_base64[(v >> 12) & 63];
+		out += g_base64[(v >> 6) & 63];
+	}
+}
+
+static int Base64Value(char c)
+{
+	if(c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if(c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if(c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if(c == '-')
+		return 62;
+	if(c == '_')
+		return 63;
+	return -1;
+}
+
+static bool Base64Decode(char const* data, std::size_t size, std::string& out)
+{
+	if(size % 4 == 1)
+		return false;
+	out.clear();
+	out.reserve(size * 3 / 4);
+	std::uint32_t v = 0;
+	int bits = 0;
+	for(std::size_t i = 0; i < size; ++i)
+	{
+		int const d = Base64Value(data[i]);
+		if(d < 0)
+			return false;
+		v = (v << 6) | static_cast<std::uint32_t>(d);
+		bits += 6;
+		if(bits >= 8)
+		{
+			bits -= 8;
+			out += static_cast<char>((v >> bits) & 0xFF);
+		}
+	}
+	return true;
+}
+
+std::string SignedCookie::Seal(std::string const& payload)
+{
+	digest_t const mac = Sign(payload);
+	std::string out;
+	out.reserve((payload.size() + mac.size()) * 4 / 3 + 4);
+	Base64Encode(out, reinterpret_cast<unsigned char const*>(payload.data()), payload.size());
+	out += '.';
+	Base64Encode(out, mac.data(), mac.size());
+	return out;
+}
+
+bool SignedCookie::Open(std::string const& cookie, std::string& payload)
+{
+	std::string::size_type const dot = cookie.find('.');
+	std::string mac;
+	if(dot == std::string::npos
+		|| !Base64Decode(cookie.data() + dot + 1, cookie.size() - dot - 1, mac)
+		|| mac.size() != 32
+		|| !Base64Decode(cookie.data(), dot, payload))
+		return false;
+	
+	// Constant time, so that the signature can't be guessed byte by byte.
+	digest_t const expected = Sign(payload);
+	unsigned char diff = 0;
+	for(std::size_t i = 0; i < expected.size(); ++i)
+		diff |= expected[i] ^ static_cast<unsigned char>(mac[i]);
+	return diff == 0;
+}
@@ -0,0 +1,16 @@
+#ifndef SIGNEDCOOKIE_H_INCLUDED
+#define SIGNEDCOOKIE_H_INCLUDED
+#include <string>
+
+// Cookie values for SessionMode = "cookie":
+// base64url(payload) "." base64url(HMAC-SHA256(SessionSecret, payload)).
+class SignedCookie {
+	SignedCookie() =delete;
+public:
+	static std::string Seal(std::string const& payload);
+	
+	// False when malformed or not signed with SessionSecret.
+	static bool Open(std::string const& cookie, std::string& payload);
+};
+
+#endif
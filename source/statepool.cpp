@@ -2,11 +2,15 @@
 #include "settings.h"
 #include "lua_fnc.h"
 #include "monitor.h"
+#include "modcache.h"
+#include "reservoir.h"
 
 #include <fstream>
+#include <thread>
 #include <iostream>
 #include <chrono>
 #include <limits>
+#include <algorithm>
 
 // Lua status missing
 static bool Handle404(std::string const& script, FCGX_Request& request)
@@ -19,6 +23,17 @@ static bool Handle404(std::string const& script, FCGX_Request& request)
 	return false;
 }
 
+// Lua status failed to load (the error itself went to the log)
+static bool Handle500(std::string const& script, FCGX_Request& request)
+{
+	std::string str;
+	str = "Status: 500 Internal Server Error\r\nContent-Type: text-plain\r\n\r\nError: Unable to load page: ";
+	str += script;
+	str += ".";
+	FCGX_PutStr(str.c_str(), str.length(), request.out);
+	return false;
+}
+
 // Load the Lua script file
 static bool InitData(LuaThreadCache& cache, std::size_t filesize, std::unique_ptr<std::ifstream>& f)
 {
@@ -42,13 +57,21 @@ static void replaceAll(std::string& str, const std::string& from, const std::str
     }
 }
 
+// Bytes currently allocated by a Lua state
+static std::size_t StateMemory(Lua::State& state)
+{
+	return static_cast<std::size_t>(state.gc(Lua::GC_COUNT, 0)) * 1024
+		+ static_cast<std::size_t>(state.gc(Lua::GC_COUNTB, 0));
+}
+
 // Create the Lua status
-static bool InitState(LuaState& lstate, LuaThreadCache const& cache, FileChangeData const& fcd)
+static bool InitState(LuaState& lstate, LuaThreadCache const& cache, FileDependencies& deps, unsigned version)
 {
 	Lua::State& state = lstate.m_luaState;
-	// Load cache.scriptData into lua state
-	state = Lua::State::create();
-	state.openlibs();
+	lstate.m_loaded.store(false, std::memory_order_relaxed);
+	DependencyScope ds(&deps);
+	if(!StateReservoir::Acquire(state))
+		return false;
 	
 	// Make package.path and package.cpath localized and safer
 	state.getglobal("package");
@@ -59,10 +82,10 @@ static bool InitState(LuaState& lstate, LuaThreadCache const& cache, FileChangeD
 		
 		replaceAll(path, ";./?.lua", "");
 		replaceAll(path, ";./?/init.lua", "");
-		path += ";" + cache.script.root() + "/?.lua";
-		path += ";" + cache.script.root() + "/?/init.lua";
-		path += ";" + cache.script.dir() + "/?.lua";
-		path += ";" + cache.script.dir() + "/?/init.lua";
+		path += ";" + cache.script->root() + "/?.lua";
+		path += ";" + cache.script->root() + "/?/init.lua";
+		path += ";" + cache.script->dir() + "/?.lua";
+		path += ";" + cache.script->dir() + "/?/init.lua";
 		
 		state.pushstdstring(path);
 		state.setfield(-2, "path");
@@ -73,22 +96,19 @@ static bool InitState(LuaState& lstate, LuaThreadCache const& cache, FileChangeD
 		state.pop(1);
 		
 		// As a security measure, do not use relative paths for .so libs.
-		replaceAll(cpath, ";./?.", ";" + cache.script.root() + "/?.");
+		replaceAll(cpath, ";./?.", ";" + cache.script->root() + "/?.");
 		
 		state.pushstdstring(cpath);
 		state.setfield(-2, "cpath");
 	}
 	state.pop(1);
 	
-	state.luapp_register_metatables();
-	
-	g_settings.TransferConfig(state);
-	
-	if(g_settings.m_luaLoadData.size())
+	// Within deps' DependencyScope, like the script: what it requires is tracked too.
+	if(g_settings->m_luaStartup.size())
 	{
 		if(state.loadbuffer(
-			g_settings.m_luaLoadData.c_str(),
-			g_settings.m_luaLoadData.size(),
+			g_settings->m_luaStartup.c_str(),
+			g_settings->m_luaStartup.size(),
 			"head") != 0)
 		{
 			if(state.isstring(-1))
@@ -111,10 +131,11 @@ static bool InitState(LuaState& lstate, LuaThreadCache const& cache, FileChangeD
 			return false;
 		}
 	}
+	
 	if(state.loadbuffer(
 		cache.scriptData.c_str(),
 		cache.scriptData.size(),
-		cache.script.get().c_str()) != 0)
+		cache.script->get().c_str()) != 0)
 	{
 		if(state.isstring(-1))
 			LogError(state.tostdstring(-1));
@@ -136,7 +157,10 @@ static bool InitState(LuaState& lstate, LuaThreadCache const& cache, FileChangeD
 		return false;
 	}
 	
-	lstate.m_chid = fcd;
+	lstate.m_version = version;
+	lstate.m_memory = StateMemory(state);
+	lstate.m_lastUsed = LuaState::clock::now();
+	lstate.m_loaded.store(true, std::memory_order_relaxed);
 	return true;
 }
 
@@ -217,20 +241,36 @@ void parseCookies(std::string& str, std::map<char const*, char const*>& data)
 	}
 }
 
-bool LuaStatePool::ExecRequest(LuaState& luaState, int sid, int tid, FCGX_Request& request, LuaThreadCache& cache, clock::time_point start)
+static void CollectGarbage(Lua::State& state, GCPolicy gcPolicy)
+{
+	switch(gcPolicy)
+	{
+	case GCP_FULL:
+	default:
+		state.gc(Lua::GC_COLLECT, 0);
+		break;
+	case GCP_STEP:
+		state.gc(Lua::GC_STEP, 0);
+		break;
+	case GCP_AUTO:
+		break;
+	}
+}
+
+bool LuaStatePool::ExecRequest(LuaState& luaState, int sid, int tid, FCGX_Request& request, LuaThreadCache& cache, GCPolicy gcPolicy, clock::time_point start)
 {
 	Lua::State& state = luaState.m_luaState;
 	cache.headers.clear();
 	cache.getsBuffer.clear();
-	cache.status = g_settings.m_defaultHttpStatus;
-	cache.contentType = g_settings.m_defaultContentType;
+	cache.status = g_settings->m_defaultHttpStatus;
+	cache.contentType = g_settings->m_defaultContentType;
 	
-	cache.headers.reserve(g_settings.m_headersize);
-	cache.body.resize(g_settings.m_bodysectors);
+	cache.headers.reserve(g_settings->m_headersize);
+	cache.body.resize(g_settings->m_bodysectors);
 	for(auto it = cache.body.begin(); it != cache.body.end(); ++it)
 	{
 		it->resize(0);
-		it->reserve(g_settings.m_bodysize);
+		it->reserve(g_settings->m_bodysize);
 	}
 	
 	std::map<char const*, char const*> cookies;
@@ -273,12 +313,12 @@ bool LuaStatePool::ExecRequest(LuaState& luaState, int sid, int tid, FCGX_Reques
 	}
 	state.setglobal("Env");
 	
-	g_settings.TransferLocalConfig(state, domain);
+	g_settings->TransferLocalConfig(state, domain);
 	
 	state.newtable();
 	for(auto it = cookies.begin(); it != cookies.end(); ++it)
 	{
-		if(!strcmp(it->first, g_settings.m_sessionName.c_str()))
+		if(!strcmp(it->first, g_settings->m_sessionName.c_str()))
 			sdd.m_sessionKey = it->second;
 		state.pushstring(it->first);
 		state.pushstring(it->second);
@@ -299,19 +339,20 @@ bool LuaStatePool::ExecRequest(LuaState& luaState, int sid, int tid, FCGX_Reques
 	lrd.m_session.Init(g_sessions, sdd);
 	SetupLuaFunctions(state, lrd);
 	
-	state.getglobal(g_settings.m_luaEntrypoint.c_str());
+	state.getglobal(g_settings->m_luaEntrypoint.c_str());
 	if(state.pcall() != 0)
 	{
 		if(state.isstring(-1))
-			LogError(cache.script.get() + ": " + state.tostdstring(-1));
+			LogError(cache.script->get() + ": " + state.tostdstring(-1));
 		else
-			LogError(cache.script.get() + ": Unknown error.");
+			LogError(cache.script->get() + ": Unknown error.");
 		
-		state.gc(Lua::GC_COLLECT, 0);
+		CollectGarbage(state, gcPolicy);
 		return false;
 	}
-	state.gc(Lua::GC_COLLECT, 0);
+	CollectGarbage(state, gcPolicy);
 	
+	lrd.m_session.Finish();
 	{
 		std::string cookieStr;
 		if(lrd.m_session.getCookieString(cookieStr, domain))
@@ -336,7 +377,7 @@ bool LuaStatePool::ExecRequest(LuaState& luaState, int sid, int tid, FCGX_Reques
 	FCGX_PutStr("\r\nX-ElapsedTime: ", 17, lrd.m_request->out);
 	FCGX_PutStr(sDur.c_str(), sDur.size(), lrd.m_request->out);
 	FCGX_PutStr("\r\n", 2, lrd.m_request->out);
-	FCGX_PutStr(g_settings.m_headers.c_str(), g_settings.m_headers.size(), lrd.m_request->out);
+	FCGX_PutStr(g_settings->m_headers.c_str(), g_settings->m_headers.size(), lrd.m_request->out);
 	FCGX_PutStr(lrd.m_cache->headers.c_str(), lrd.m_cache->headers.size(), lrd.m_request->out);
 	FCGX_PutStr("Content-Length: ", 16, lrd.m_request->out);
 	FCGX_PutStr(contentSizeStr, c, lrd.m_request->out);
@@ -365,195 +406,502 @@ bool LuaStatePool::ExecMT(int tid, FCGX_Request& request, LuaThreadCache& cache)
 		return false;
 	}
 	
-	cache.script = FileMonitor::simplify(script, root);
+	cache.script = FileMonitor::intern(script, root);
 	
-	std::map<std::string,LuaPool>::iterator selIterator;
+	std::string const& path = cache.script->get();
+	std::size_t const hash = cache.script->hash();
+	auto SamePath = [&](LuaPool const& p) -> bool {
+		return p.m_script == cache.script
+			|| (p.m_script->get() == path && p.m_script->root() == cache.script->root());
+	};
+	
+	LuaPool* pool = nullptr;
 	LuaState* selState = nullptr;
 	int selStateNum = -1;
 	std::unique_ptr<LuaState> ownState;
 	
-	// 0 -> Error, can't open file or such.
-	// 1 -> Good, but our cache is outdated.
-	// 2 -> Perfect. The file is up to date.
-	
-	auto LoadScript = [&](FileChangeData& chid, bool brandNew) -> int
+	// Read the script into cache.scriptData.
+	// Freshness is the scanner's job: this is only called to (re)load states.
+	auto LoadScript = [&](FileChangeData& chid) -> bool
 	{
-		std::unique_ptr<std::ifstream> f = FileMonitor::getFileForLoading(cache.script, chid, brandNew);
-		if(!chid.m_exists
-			|| (f && !InitData(cache, chid.m_filesize, f)))
-			return 0; // Handle404(cache.script.get(), request);
-		return (f) ? 1 : 2;
+		std::unique_ptr<std::ifstream> f = FileMonitor::getFileForLoading(*cache.script, chid, true);
+		return chid.m_exists && f && InitData(cache, chid.m_filesize, f);
 	};
 	
-	FileChangeData poolChangeData;
+	pool = m_pool.find(hash, SamePath);
+	if(pool && pool->Failed())
+		return Handle500(path, request);
+	if(!pool)
 	{
-		m_poolMutex.lock_read();
-		std::lock_guard<rw_mutex> lg(m_poolMutex, std::adopt_lock);
+		if(MissingFiles::Contains(*cache.script))
+			return Handle404(path, request);
 		
-		selIterator = m_pool.find(cache.script.get());
-		if(selIterator == m_pool.end())
+		FileChangeData fcd;
+		if(!LoadScript(fcd))
 		{
-			FileChangeData fcd;
-			if(LoadScript(fcd, true) != 1)
-				return Handle404(cache.script.get(), request);
-			
-			// Insert a new pair to std::map and populate it.
-			m_poolMutex.chlock_w();
-			
-			auto pairResult = m_pool.emplace(std::make_pair(cache.script.get(),LuaStatePool::LuaPool()));
-			selIterator = pairResult.first;
-			selIterator->second.m_mostRecentChange = fcd;
+			if(!fcd.m_exists)
+				MissingFiles::Add(*cache.script);
+			return Handle404(path, request);
+		}
+		
+		std::shared_ptr<FileWatch> watch = FileWatcher::Watch(path, cache.script->dir());
+		bool created = false;
+		{
+			std::lock_guard<std::mutex> lg(m_writeMutex);
 			
-			// This pair could be already populated if another thread ran chlock_w slightly before.
-			LuaStateContainer& states = selIterator->second.m_states;
-			int targetStates = g_settings.m_states;
-			if(static_cast<int>(states.size()) < targetStates)
+			// Another thread could have created it slightly before.
+			pool = m_pool.find(hash, SamePath);
+			if(!pool)
+			{
+				pool = new LuaPool(cache.script, g_settings->ResolvePoolRules(path), watch);
+				pool->SetMostRecentChange(fcd);
+				m_pool.insert(hash, pool);
+				created = true;
+			}
+		}
+		
+		if(created)
+		{
+			// Populate the initial states outside of the lock,
+			// and grab the last generated state for this request.
+			for(int i = 0; i < pool->m_rules.m_states; ++i)
 			{
-				while(static_cast<int>(states.size()) < targetStates)
+				LuaState& s = pool->m_states[i];
+				if(s.m_inUse.test_and_set(std::memory_order_acquire))
+					continue;
+				if(!InitState(s, cache, pool->m_deps, 0))
 				{
-					states.emplace_back();
-					if(!InitState(states.back(), cache, fcd))
-					{
-						states.pop_back();
-						return false;
-					}
+					pool->SetFailed(0);
+					s.m_inUse.clear(std::memory_order_release);
+					if(selState)
+						selState->m_inUse.clear(std::memory_order_release);
+					return Handle500(path, request);
 				}
-				
-				// Also grab the last generated state for future usage.
-				selState = &(states.back());
-				selStateNum = states.size();
-				selState->m_inUse.test_and_set(std::memory_order_acquire);
+				if(selState)
+					selState->m_inUse.clear(std::memory_order_release);
+				selState = &s;
+				selStateNum = i;
 			}
-			
-			m_poolMutex.chlock_r();
 		}
+	}
+	
+	// pool points to a good pool
+	// selState might already point to a good state.
+	
+	int const slots = pool->m_rules.m_maxstates;
+	if(!selState)
+	{
+		// Try finding a free, loaded state for the required script
+		int max_retries = pool->m_rules.m_seek_retries;
 		
-		// m_poolMutex is in read state
-		// selIterator points to a good pair
-		// selState might already point to a good state.
-		
-		if(!selState)
+		for(int i = 0; !selState && (i < max_retries); ++i)
 		{
-			// We need to find a selState.
-			
-			// Try finding a good state for the required script
-			LuaStateContainer& states = selIterator->second.m_states;
-			int max_retries = g_settings.m_seek_retries;
+			if(i > 0)
+				std::this_thread::yield();
 			
-			for(int i = 0; !selState && (i < max_retries); ++i)
+			for(int x = 0; x < slots; ++x)
 			{
-				if(i > 0)
-					std::this_thread::yield();
-				
-				int x = 0;
-				for(auto it = states.begin(); it != states.end(); ++it, ++x)
+				LuaState& s = pool->m_states[x];
+				if(!s.m_loaded.load(std::memory_order_relaxed))
+					continue;
+				if(!s.m_inUse.test_and_set(std::memory_order_acquire))
 				{
-					if(!it->m_inUse.test_and_set(std::memory_order_acquire))
+					if(s.m_loaded.load(std::memory_order_relaxed))
 					{
-						selState = &(*it);
+						selState = &s;
 						selStateNum = x;
 						break;
 					}
+					s.m_inUse.clear(std::memory_order_release);
 				}
 			}
 		}
-			
+	}
+	
+	if(!selState)
+	{
+		unsigned version = pool->m_version.load(std::memory_order_acquire);
+		FileChangeData fcd;
+		if(!LoadScript(fcd))
+			return Handle404(path, request);
+		// No selState has been found.
+		// As a last resort, create a new selState (and, if rules allow, store it)
+		
+		// Our pool has an empty slot left (maxstates)
+		for(int x = 0; !selState && x < slots; ++x)
+		{
+			LuaState& s = pool->m_states[x];
+			if(s.m_loaded.load(std::memory_order_relaxed)
+				|| s.m_inUse.test_and_set(std::memory_order_acquire))
+				continue;
+			if(s.m_loaded.load(std::memory_order_relaxed))
+			{
+				s.m_inUse.clear(std::memory_order_release);
+				continue;
+			}
+			if(!InitState(s, cache, pool->m_deps, version))
+			{
+				pool->SetFailed(version);
+				s.m_inUse.clear(std::memory_order_release);
+				return Handle500(path, request);
+			}
+			selState = &s;
+			selStateNum = x;
+		}
+		
 		if(!selState)
 		{
-			FileChangeData fcd;
-			if(LoadScript(fcd, true) != 1)
-				return Handle404(cache.script.get(), request);
-			// No selState has been found.
-			// As a last resort, create a new selState (and, if rules allow, store it)
-			m_poolMutex.chlock_w();
-			
-			selIterator->second.m_mostRecentChange = fcd;
-			LuaStateContainer& states = selIterator->second.m_states;
-			int stateLimit = g_settings.m_maxstates;
-			
-			// Our container can fit another element (maxstates)
-			if(static_cast<int>(states.size()) < stateLimit)
+			// We have already reached maxstates.
+			// Create a temporary LuaState.
+			ownState.reset(new LuaState);
+			if(InitState(*ownState, cache, pool->m_deps, version))
 			{
-				states.emplace_back();
-				if(!InitState(states.back(), cache, fcd))
-				{
-					states.pop_back();
-					return false;
-				}
-				selState = &(states.back());
-				selStateNum = states.size();
+				selState = ownState.get();
 				selState->m_inUse.test_and_set(std::memory_order_acquire);
 			}
 			else
 			{
-				// We have already reached maxstates.
-				// Create a temporary LuaState.
-				ownState.reset(new LuaState);
-				if(InitState(*ownState, cache, fcd))
-				{
-					selState = ownState.get();
-					selState->m_inUse.test_and_set(std::memory_order_acquire);
-				}
-				else
-					return false; // Error loading script
+				// Error loading script
+				pool->SetFailed(version);
+				return Handle500(path, request);
 			}
 		}
-		poolChangeData = selIterator->second.m_mostRecentChange;
-		selIterator = m_pool.end(); // Giving up the mutex. Don't use selIterator anymore.
 	}
+	GCPolicy gcPolicy = pool->m_rules.m_gcPolicy;
 	
-	bool bForceReload = poolChangeData != selState->m_chid;
-	switch(LoadScript(selState->m_chid, bForceReload))
+	// The scanner bumps m_version when the script changes.
+	unsigned version = pool->m_version.load(std::memory_order_acquire);
+	if(selState->m_version != version)
 	{
-	case 0:
-	default:
-		return Handle404(cache.script.get(), request);
-	case 1:
-		// InitData has already been called.
-		// All we need is already in the cache.
-		if(!InitState(*selState, cache, selState->m_chid))
-			return false;
-		break;
-	case 2:
-		// No need to call anything.
-		break;
+		FileChangeData fcd;
+		if(!LoadScript(fcd))
+		{
+			selState->m_inUse.clear(std::memory_order_release);
+			return Handle404(path, request);
+		}
+		if(!InitState(*selState, cache, pool->m_deps, version))
+		{
+			pool->SetFailed(version);
+			selState->m_inUse.clear(std::memory_order_release);
+			return Handle500(path, request);
+		}
 	}
 	
 	// At this point, selState is finally valid, loaded and up-to-date.
 	bool rv = false;
 	try {
 		// Elaborate the request here.
-		rv = ExecRequest(*selState, selStateNum, tid, request, cache, start);
+		DependencyScope ds(&pool->m_deps);
+		rv = ExecRequest(*selState, selStateNum, tid, request, cache, gcPolicy, start);
 	}
 	catch(std::exception& e) {
-		LogError(cache.script.get() + ": " + e.what());
+		LogError(path + ": " + e.what());
 	}
 	catch(...) {
-		LogError(cache.script.get() + ": Unknown exception thrown.");
+		LogError(path + ": Unknown exception thrown.");
 	}
+	selState->m_lastUsed = LuaState::clock::now();
+	selState->m_memory = StateMemory(selState->m_luaState);
 	selState->m_inUse.clear(std::memory_order_release);
 	return rv;
 }
 
+LuaStatePool::LuaPool::LuaPool(PathHandle const& script, PoolRules const& rules, std::shared_ptr<FileWatch> const& watch) :
+	m_script(script),
+	m_rules(rules),
+	m_watch(watch),
+	m_version(0),
+	m_failedVersion(NO_FAILURE),
+	m_configGeneration(g_settings->m_configGeneration),
+	m_states(new LuaState[rules.m_maxstates])
+{}
+
+LuaStatePool::LuaPool::~LuaPool()
+{
+	for(int i = 0; i < m_rules.m_maxstates; ++i)
+	{
+		if(m_states[i].m_loaded.load(std::memory_order_relaxed))
+			m_states[i].m_luaState.close();
+	}
+}
+
+FileChangeData LuaStatePool::LuaPool::MostRecentChange()
+{
+	spinlock_guard lg(m_changeMutex);
+	return m_mostRecentChange;
+}
+
+void LuaStatePool::LuaPool::SetMostRecentChange(FileChangeData const& fcd)
+{
+	spinlock_guard lg(m_changeMutex);
+	m_mostRecentChange = fcd;
+}
+
+bool LuaStatePool::LuaPool::Failed() const
+{
+	return m_failedVersion.load(std::memory_order_acquire) == m_version.load(std::memory_order_acquire);
+}
+
+void LuaStatePool::LuaPool::SetFailed(unsigned version)
+{
+	m_failedVersion.store(version, std::memory_order_release);
+}
 
-bool LuaStatePool::Start()
+// Claim every slot of a pool without loaded states, so that it can be removed.
+// Pools remembering a failure are kept until their script changes.
+bool LuaStatePool::LuaPool::TryRetire()
 {
-	// Just a placeholder for possible future implementation
+	if(Failed())
+		return false;
+	int claimed = 0;
+	for(; claimed < m_rules.m_maxstates; ++claimed)
+	{
+		LuaState& s = m_states[claimed];
+		if(s.m_inUse.test_and_set(std::memory_order_acquire))
+			break;
+		if(s.m_loaded.load(std::memory_order_relaxed))
+		{
+			s.m_inUse.clear(std::memory_order_release);
+			break;
+		}
+	}
+	if(claimed == m_rules.m_maxstates)
+		return true;
+	
+	while(claimed-- > 0)
+		m_states[claimed].m_inUse.clear(std::memory_order_release);
+	return false;
+}
+
+LuaStatePool::LuaStatePool() :
+	m_evictedStates(0),
+	m_evictedPools(0),
+	m_rebuiltPools(0),
+	m_loadedStates(0),
+	m_loadedMemory(0)
+{}
+
+bool LuaStatePool::Start(int scannerTid)
+{
+	if(!FileWatcher::Start())
+		return false;
+	StateReservoir::Start();
+	std::thread(&LuaStatePool::RunScanner, this, scannerTid).detach();
 	return true;
 }
 
-std::map<std::string, int> LuaStatePool::ServerInfo()
+// Check every pool's script and required modules once per MinFileInfoTime
+// (or as soon as a FileWatch reports a change), on behalf of all of its states,
+// and rebuild the pools that changed. After a configuration reload, the
+// pools built with the previous one are rebuilt a few at a time.
+void LuaStatePool::RunScanner(int tid)
 {
-	m_poolMutex.lock_read();
-	std::lock_guard<rw_mutex> lg(m_poolMutex, std::adopt_lock);
-	std::map<std::string, int> data;
+	int const maxReconfigured = 8; // Per pass
+	LuaThreadCache cache;
+	std::vector<LuaPool*> changed;
+	while(true)
+	{
+		int period;
+		{
+			SettingsScope ss;
+			period = std::max(10, std::min(g_settings->m_fileInfoTime, 1000));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(period));
+		
+		RcuSection rs(tid);
+		SettingsScope ss;
+		int const generation = g_settings->m_configGeneration;
+		int reconfigured = 0;
+		changed.clear();
+		m_pool.for_each([&](LuaPool& pool) {
+			FileChangeData fcd = pool.MostRecentChange();
+			std::unique_ptr<std::ifstream> f = FileMonitor::getFileForLoading(*pool.m_script, fcd,
+				false, pool.m_watch.get());
+			pool.SetMostRecentChange(fcd);
+			bool const depsChanged = pool.m_deps.Changed();
+			if(f || depsChanged)
+				changed.push_back(&pool);
+			else if(pool.m_configGeneration.load(std::memory_order_relaxed) != generation
+				&& reconfigured < maxReconfigured)
+			{
+				changed.push_back(&pool);
+				++reconfigured;
+			}
+		});
+		
+		for(auto it = changed.begin(); it != changed.end(); ++it)
+			RebuildPool(**it, cache);
+	}
+}
+
+// Load a replacement for pool with as many states as it has loaded, while
+// it keeps serving requests, then swap them. Must run inside an RcuSection.
+// When that fails, the requests find out by themselves: the script is
+// gone (404) or broken (500, remembered until the next change).
+void LuaStatePool::RebuildPool(LuaPool& pool, LuaThreadCache& cache)
+{
+	cache.script = pool.m_script;
+	FileChangeData fcd;
+	std::unique_ptr<std::ifstream> f = FileMonitor::getFileForLoading(*pool.m_script, fcd, true);
+	// Whatever happens, the states reload with the current configuration.
+	pool.m_configGeneration.store(g_settings->m_configGeneration, std::memory_order_relaxed);
+	if(!fcd.m_exists || !f || !InitData(cache, fcd.m_filesize, f))
+	{
+		pool.m_version.fetch_add(1, std::memory_order_acq_rel);
+		return;
+	}
+	
+	PoolRules const rules = g_settings->ResolvePoolRules(pool.m_script->get());
+	int count = 0;
+	for(int i = 0; i < pool.m_rules.m_maxstates; ++i)
+	{
+		if(pool.m_states[i].m_loaded.load(std::memory_order_relaxed))
+			++count;
+	}
+	count = std::min(std::max(count, rules.m_states), rules.m_maxstates);
 	
-	for(auto it = m_pool.begin(); it != m_pool.end(); ++it)
+	std::unique_ptr<LuaPool> fresh(new LuaPool(pool.m_script, rules, pool.m_watch));
+	fresh->SetMostRecentChange(fcd);
+	for(int i = 0; i < count; ++i)
 	{
-		data[it->first] = it->second.m_states.size();
+		if(!InitState(fresh->m_states[i], cache, fresh->m_deps, 0))
+		{
+			pool.SetFailed(pool.m_version.fetch_add(1, std::memory_order_acq_rel) + 1);
+			return;
+		}
 	}
 	
+	{
+		std::lock_guard<std::mutex> lg(m_writeMutex);
+		// Evicted in the meantime: nobody is waiting for it.
+		if(!m_pool.replace(pool.m_script->hash(), &pool, fresh.get()))
+			return;
+	}
+	LuaPool* old = &pool;
+	fresh.release();
+	Rcu::Retire([old]() { delete old; });
+	++m_rebuiltPools;
+}
+
+void LuaStatePool::EnforceBudget()
+{
+	struct Candidate {
+		bool m_expired;
+		LuaState::clock::time_point m_lastUsed;
+		LuaState* m_state;
+	};
+
+	std::size_t const maxStates = static_cast<std::size_t>(g_settings->m_globalMaxStates);
+	std::size_t const maxMemory = static_cast<std::size_t>(g_settings->m_globalMaxMemory) * 1024;
+	LuaState::clock::time_point const now = LuaState::clock::now();
+
+	std::lock_guard<std::mutex> lg(m_writeMutex);
+
+	// Claim every idle state, so that no request thread can grab it from us.
+	std::vector<Candidate> idle;
+	std::size_t states = 0;
+	std::size_t memory = 0;
+	bool expired = false;
+	m_pool.for_each([&](LuaPool& pool) {
+		std::chrono::seconds const idleTime(pool.m_rules.m_idleTime);
+		for(int i = 0; i < pool.m_rules.m_maxstates; ++i)
+		{
+			LuaState& s = pool.m_states[i];
+			if(!s.m_loaded.load(std::memory_order_relaxed))
+				continue;
+			++states;
+			memory += s.m_memory.load(std::memory_order_relaxed);
+			if(s.m_inUse.test_and_set(std::memory_order_acquire))
+				continue;
+			if(!s.m_loaded.load(std::memory_order_relaxed))
+			{
+				s.m_inUse.clear(std::memory_order_release);
+				continue;
+			}
+			bool stale = idleTime.count() > 0 && (now - s.m_lastUsed) > idleTime;
+			expired = expired || stale;
+			idle.push_back(Candidate{stale, s.m_lastUsed, &s});
+		}
+	});
+
+	auto overBudget = [&]() -> bool {
+		return (maxStates && states > maxStates)
+			|| (maxMemory && memory > maxMemory);
+	};
+
+	auto it = idle.begin();
+	if(expired || overBudget())
+	{
+		// Expired states first, then least recently used.
+		std::sort(idle.begin(), idle.end(), [](Candidate const& a, Candidate const& b) {
+			if(a.m_expired != b.m_expired)
+				return a.m_expired;
+			return a.m_lastUsed < b.m_lastUsed;
+		});
+
+		for(; it != idle.end() && (it->m_expired || overBudget()); ++it)
+		{
+			--states;
+			memory -= it->m_state->m_memory.load(std::memory_order_relaxed);
+			it->m_state->m_luaState.close();
+			it->m_state->m_loaded.store(false, std::memory_order_relaxed);
+			it->m_state->m_inUse.clear(std::memory_order_release);
+			++m_evictedStates;
+		}
+	}
+	for(; it != idle.end(); ++it)
+		it->m_state->m_inUse.clear(std::memory_order_release);
+
+	// Drop the pools left without states. Request threads that already
+	// found one fall back to a temporary state until it is reclaimed.
+	std::vector<LuaPool*> empty;
+	m_pool.for_each([&](LuaPool& pool) {
+		if(pool.TryRetire())
+			empty.push_back(&pool);
+	});
+	for(auto pit = empty.begin(); pit != empty.end(); ++pit)
+	{
+		LuaPool* pool = *pit;
+		m_pool.erase(pool->m_script->hash(), pool);
+		Rcu::Retire([pool]() { delete pool; });
+		++m_evictedPools;
+	}
+
+	m_loadedStates = static_cast<int>(states);
+	m_loadedMemory = static_cast<int>(memory / 1024);
+}
+
+std::map<std::string, int> LuaStatePool::ServerInfo()
+{
+	std::map<std::string, int> data;
+	
+	m_pool.for_each([&](LuaPool const& pool) {
+		int loaded = 0;
+		for(int i = 0; i < pool.m_rules.m_maxstates; ++i)
+		{
+			if(pool.m_states[i].m_loaded.load(std::memory_order_relaxed))
+				++loaded;
+		}
+		data[pool.m_script->get()] += loaded;
+	});
+	
+	return data;
+}
+
+std::map<std::string, int> LuaStatePool::PoolStats()
+{
+	std::map<std::string, int> data;
+	data["LoadedStates"] = m_loadedStates.load();
+	data["LoadedMemory"] = m_loadedMemory.load();
+	data["EvictedStates"] = m_evictedStates.load();
+	data["EvictedPools"] = m_evictedPools.load();
+	data["RebuiltPools"] = m_rebuiltPools.load();
+	data["MaxStates"] = g_settings->m_globalMaxStates;
+	data["MaxMemory"] = g_settings->m_globalMaxMemory;
+	data["ModuleCacheMemory"] = static_cast<int>(ModuleCache::Size() / 1024);
+	std::map<std::string, int> reservoir = StateReservoir::Stats();
+	data.insert(reservoir.begin(), reservoir.end());
 	return data;
 }
 
-LuaStatePool g_statepool;
\ No newline at end of file
+LuaStatePool g_statepool;
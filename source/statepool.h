@@ -1,23 +1,34 @@
 #ifndef STATEPOOL_H_INCLUDED
 #define STATEPOOL_H_INCLUDED
-#include <list>
 #include <vector>
 #include <atomic>
 #include <string>
 #include <map>
+#include <mutex>
+#include <chrono>
+#include <memory>
 #include <fcgiapp.h>
-#include "rw_mutex.h"
+#include "spinlock_mutex.h"
 #include "state.h"
 #include "monitor.h"
+#include "rcu.h"
 
 struct LuaState {
+	typedef std::chrono::steady_clock clock;
+	inline LuaState() : m_inUse(ATOMIC_FLAG_INIT), m_loaded(false), m_memory(0), m_version(0) {}
+
 	std::atomic_flag m_inUse;
-	FileChangeData m_chid;
+
+	// Written only by the thread holding m_inUse.
+	std::atomic<bool> m_loaded;
+	std::atomic<std::size_t> m_memory;
+	unsigned m_version; // LuaPool::m_version of the loaded script
 	Lua::State m_luaState;
+	clock::time_point m_lastUsed;
 };
 
 struct LuaThreadCache {
-	SimplifiedPath script;
+	PathHandle script;
 	std::string scriptData;
 	std::string headers;
 	std::vector<std::string> body;
@@ -27,22 +38,62 @@ struct LuaThreadCache {
 };
 
 class LuaStatePool {
-	typedef std::list<LuaState> LuaStateContainer;
 	typedef std::chrono::high_resolution_clock clock;
 
 	struct LuaPool {
-		LuaStateContainer m_states;
+		LuaPool(PathHandle const& script, PoolRules const& rules, std::shared_ptr<FileWatch> const& watch);
+		~LuaPool();
+
+		PathHandle const m_script;
+		PoolRules const m_rules;
+		std::shared_ptr<FileWatch> const m_watch; // Null when not watched
+		std::atomic<unsigned> m_version; // Bumped by the scanner on changes
+		std::atomic<unsigned> m_failedVersion; // Version that failed to load, or NO_FAILURE
+		std::atomic<int> m_configGeneration; // Settings::m_configGeneration of its states
+		FileDependencies m_deps; // Modules required by the states
+		std::unique_ptr<LuaState[]> m_states; // m_rules.m_maxstates slots
+
+		// Last status seen by the scanner
+		spinlock_mutex m_changeMutex;
 		FileChangeData m_mostRecentChange;
+
+		FileChangeData MostRecentChange();
+		void SetMostRecentChange(FileChangeData const&);
+		bool Failed() const;
+		void SetFailed(unsigned version);
+		bool TryRetire();
 	};
+	static unsigned const NO_FAILURE = ~0u;
 
-	rw_mutex m_poolMutex;
-	std::map<std::string,LuaPool> m_pool;
+	// Lookups are lock-free; m_writeMutex serializes pool creation and removal.
+	RcuTable<LuaPool> m_pool;
+	std::mutex m_writeMutex;
 
-	bool ExecRequest(LuaState& state, int sid, int tid, FCGX_Request& request, LuaThreadCache& cache, clock::time_point start);
+	std::atomic<int> m_evictedStates;
+	std::atomic<int> m_evictedPools;
+	std::atomic<int> m_rebuiltPools;
+	std::atomic<int> m_loadedStates;
+	std::atomic<int> m_loadedMemory; // KB
+
+	bool ExecRequest(LuaState& state, int sid, int tid, FCGX_Request& request, LuaThreadCache& cache, GCPolicy gcPolicy, clock::time_point start);
+	void RunScanner(int tid);
+	void RebuildPool(LuaPool& pool, LuaThreadCache& cache);
 public:
-	bool Start();
+	LuaStatePool();
+	
+	// Starts the background threads. The scanner uses scannerTid as its Rcu slot.
+	bool Start(int scannerTid);
+
+	// Must run inside an RcuSection.
 	bool ExecMT(int tid, FCGX_Request& request, LuaThreadCache& cache);
+
+	// Unload the states idle for longer than their pool's IdleTime, then
+	// evict the least recently used idle states (and the pools left empty)
+	// until the global LuaGlobalMaxStates / LuaGlobalMaxMemory budget is met.
+	void EnforceBudget();
+
 	std::map<std::string, int> ServerInfo();
+	std::map<std::string, int> PoolStats();
 };
 
 extern LuaStatePool g_statepool;
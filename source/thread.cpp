@@ -1,6 +1,7 @@
 #include "thread.h"
 #include "settings.h"
 #include "statepool.h"
+#include "rcu.h"
 #include <fcgiapp.h>
 #include <mutex>
 
@@ -19,6 +20,8 @@ void RunThread(int tid, int sock)
 		g_acceptMutex.unlock();
 		
 		try {
+			RcuSection rs(tid);
+			SettingsScope ss;
 			g_statepool.ExecMT(tid, request, cache);
 		} catch(std::exception& e) {
 			LogError(std::string("Thread-level exception: ") + e.what());
@@ -0,0 +1,75 @@
+// Cost of FileMonitor::getFileStatus in each FileFingerprint mode, against
+// the SHA-256 over an ifstream that FileMonitor used before the modes.
+#include "test.h"
+#include "monitor.h"
+#include <picosha2.h>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static double MicrosecondsPerCall(std::string const& path, int calls, bool ifstreamSha256)
+{
+	auto const start = std::chrono::steady_clock::now();
+	for(int i = 0; i < calls; ++i)
+	{
+		if(ifstreamSha256)
+		{
+			std::ifstream f(path, std::ios::binary);
+			std::array<std::uint8_t, 32> hash;
+			picosha2::hash256(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>(),
+				hash.begin(), hash.end());
+		}
+		else
+			FileMonitor::getFileStatus(path);
+	}
+	std::chrono::duration<double, std::micro> const elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / calls;
+}
+
+int main()
+{
+	std::string const dir = TestDirectory();
+	std::size_t const sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+	struct {
+		char const* m_name;
+		FingerprintMode m_mode;
+		bool m_ifstream;
+	} const modes[] = {
+		{ "stat", FP_STAT, false },
+		{ "hash", FP_HASH, false },
+		{ "sha256", FP_SHA256, false },
+		{ "sha256 (ifstream)", FP_SHA256, true }
+	};
+
+	std::printf("%-18s %10s %14s %10s\n", "FileFingerprint", "size", "us/call", "MB/s");
+	for(std::size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		std::string const path = dir + "/script" + std::to_string(s) + ".lua";
+		{
+			std::vector<char> data(sizes[s]);
+			for(std::size_t i = 0; i < data.size(); ++i)
+				data[i] = static_cast<char>("local x = 1\n"[i % 12]);
+			std::ofstream out(path, std::ios::binary);
+			out.write(&data[0], data.size());
+		}
+		// About 64 MB read per mode and size.
+		int const calls = static_cast<int>(64 * 1024 * 1024 / sizes[s]);
+
+		for(std::size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m)
+		{
+			FingerprintMode const mode = modes[m].m_mode;
+			PublishTestSettings([mode](Settings& settings) { settings.m_fingerprint = mode; });
+
+			MicrosecondsPerCall(path, calls / 16 + 1, modes[m].m_ifstream); // Warm up
+			double const us = MicrosecondsPerCall(path, calls, modes[m].m_ifstream);
+			std::printf("%-18s %10zu %14.2f %10.0f\n", modes[m].m_name, sizes[s], us,
+				mode == FP_STAT ? 0.0 : sizes[s] / us);
+		}
+		std::remove(path.c_str());
+	}
+	rmdir(dir.c_str());
+	return TestResult("bench_fingerprint");
+}
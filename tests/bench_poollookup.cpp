@@ -0,0 +1,116 @@
+// Cost of finding the pool of an already loaded script, as ExecMT does, on
+// 1 to 8 request threads: the lock-free RcuTable inside an RcuSection,
+// against the rw_mutex read lock and std::map it replaced.
+#include "test.h"
+#include "monitor.h"
+#include "rcu.h"
+#include "rw_mutex.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum {
+	POOLS = 64,
+	MAX_THREADS = 8
+};
+
+// Just what the lookups look at.
+struct BenchPool {
+	PathHandle m_script;
+};
+
+static RcuTable<BenchPool> g_table;
+static rw_mutex g_poolMutex;
+static std::map<std::string, BenchPool> g_map;
+static std::vector<PathHandle> g_scripts;
+
+// Keeps the lookups from being optimized away.
+static std::atomic<unsigned> g_sink(0);
+
+static bool FindRcu(int tid, PathHandle const& script)
+{
+	RcuSection rs(tid);
+	std::string const& path = script->get();
+	auto SamePath = [&](BenchPool const& p) -> bool {
+		return p.m_script == script
+			|| (p.m_script->get() == path && p.m_script->root() == script->root());
+	};
+	return g_table.find(script->hash(), SamePath) != nullptr;
+}
+
+static bool FindLocked(int, PathHandle const& script)
+{
+	g_poolMutex.lock_read();
+	std::lock_guard<rw_mutex> lg(g_poolMutex, std::adopt_lock);
+	return g_map.find(script->get()) != g_map.end();
+}
+
+// Each thread looks up every pool in turn. Returns the wall time, in ns,
+// per lookup of a single thread.
+template <typename Fn>
+static double NanosecondsPerLookup(int threads, int lookups, Fn const& find)
+{
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> workers;
+	for(int t = 0; t < threads; ++t)
+	{
+		workers.emplace_back([&, t]() {
+			unsigned found = 0;
+			++ready;
+			while(!go.load())
+				std::this_thread::yield();
+			for(int i = 0; i < lookups; ++i)
+				found += find(t, g_scripts[i % POOLS]);
+			g_sink += found;
+		});
+	}
+	while(ready.load() < threads)
+		std::this_thread::yield();
+	auto const start = std::chrono::steady_clock::now();
+	go = true;
+	for(auto& worker : workers)
+		worker.join();
+	std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / lookups;
+}
+
+int main()
+{
+	PublishTestSettings();
+	Rcu::Setup(MAX_THREADS + 1);
+	{
+		RcuSection rs(MAX_THREADS);
+		for(int i = 0; i < POOLS; ++i)
+		{
+			std::string const script = "/srv/www/site/scripts/page" + std::to_string(i) + ".lua";
+			PathHandle path = FileMonitor::intern(script.c_str(), "/srv/www/site");
+			g_scripts.push_back(path);
+			g_table.insert(path->hash(), new BenchPool{path});
+			g_map.insert(std::make_pair(path->get(), BenchPool{path}));
+		}
+	}
+	Rcu::Reclaim();
+
+	int const lookups = 1000000;
+	int const threadCounts[] = { 1, 2, 4, 8 };
+	std::printf("%-12s %8s %12s %18s\n", "lookup", "threads", "ns/lookup", "Mlookups/s/thread");
+	for(std::size_t n = 0; n < sizeof(threadCounts) / sizeof(threadCounts[0]); ++n)
+	{
+		int const threads = threadCounts[n];
+		NanosecondsPerLookup(threads, lookups / 16, FindRcu); // Warm up
+		double const rcu = NanosecondsPerLookup(threads, lookups, FindRcu);
+		std::printf("%-12s %8d %12.1f %18.2f\n", "RcuTable", threads, rcu, 1000.0 / rcu);
+		NanosecondsPerLookup(threads, lookups / 16, FindLocked);
+		double const locked = NanosecondsPerLookup(threads, lookups, FindLocked);
+		std::printf("%-12s %8d %12.1f %18.2f\n", "rw_mutex+map", threads, locked, 1000.0 / locked);
+	}
+	CHECK(g_sink.load() > 0);
+	return TestResult("bench_poollookup");
+}
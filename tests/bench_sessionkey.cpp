@@ -0,0 +1,56 @@
+// Cost of SessionManager::CreateSessionKey, against the randutils
+// generator it used before SecureRandom: an mt19937 seeded per key.
+#include "test.h"
+#include "session.h"
+#include "randutils.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+static char const g_selCharacters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+
+// Keeps the keys from being optimized away.
+static volatile unsigned g_sink;
+
+static void RandutilsSessionKey(std::string& result, int klen)
+{
+	randutils::mt19937_rng generator;
+	result.resize(klen);
+	for(int i = 0; i < klen; ++i)
+		result[i] = g_selCharacters[generator.uniform(0, static_cast<int>(sizeof(g_selCharacters)) - 2)];
+}
+
+template <typename Fn>
+static double NanosecondsPerKey(int keys, Fn const& create)
+{
+	std::string key;
+	auto const start = std::chrono::steady_clock::now();
+	for(int i = 0; i < keys; ++i)
+	{
+		create(key);
+		g_sink = static_cast<unsigned char>(key[0]);
+	}
+	std::chrono::duration<double, std::nano> const elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / keys;
+}
+
+int main()
+{
+	int const lengths[] = { 16, 32, 64 };
+	int const keys = 200000;
+
+	std::printf("%-12s %10s %14s\n", "generator", "length", "ns/key");
+	for(std::size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l)
+	{
+		int const klen = lengths[l];
+		PublishTestSettings([klen](Settings& settings) { settings.m_sessionKeyLen = klen; });
+
+		auto chacha = [](std::string& key) { SessionManager::CreateSessionKey(key); };
+		auto randutils = [klen](std::string& key) { RandutilsSessionKey(key, klen); };
+		NanosecondsPerKey(keys / 16, chacha); // Warm up
+		std::printf("%-12s %10d %14.1f\n", "SecureRandom", klen, NanosecondsPerKey(keys, chacha));
+		NanosecondsPerKey(keys / 16, randutils);
+		std::printf("%-12s %10d %14.1f\n", "randutils", klen, NanosecondsPerKey(keys, randutils));
+	}
+	return TestResult("bench_sessionkey");
+}
@@ -0,0 +1,65 @@
+#ifndef TEST_H_INCLUDED
+#define TEST_H_INCLUDED
+#include <iostream>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+#include "settings.h"
+
+// Every tests/test_*.cpp is a program of its own (make test), linked with
+// everything but main.cpp and thread.cpp. CHECK reports a failure and
+// keeps going; TestResult turns the count into the exit status.
+static std::atomic<int> g_testFailures(0);
+
+#define CHECK(cond) \
+	do { \
+		if(!(cond)) { \
+			++g_testFailures; \
+			LogError(std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": CHECK(" #cond ") failed"); \
+		} \
+	} while(0)
+
+// Default settings with the compiled prelude, adjusted by setup, then
+// published. The calling thread becomes the one allowed to read them
+// outside of a SettingsScope, like main's.
+template <typename Fn>
+inline void PublishTestSettings(Fn const& setup)
+{
+	std::shared_ptr<Settings> settings = std::make_shared<Settings>();
+	settings->LoadSettings(std::string());
+	setup(*settings);
+	Settings::Publish(settings);
+}
+
+inline void PublishTestSettings()
+{
+	PublishTestSettings([](Settings&) {});
+}
+
+// An empty directory under /tmp for the test's files.
+inline std::string TestDirectory()
+{
+	char path[] = "/tmp/luafcgid2-test-XXXXXX";
+	if(!mkdtemp(path))
+	{
+		LogError("Unable to create a test directory.");
+		std::exit(2);
+	}
+	return path;
+}
+
+// Background threads (scanner, reservoir...) never stop: don't run the
+// static destructors under them.
+inline int TestResult(char const* name)
+{
+	if(g_testFailures)
+		LogError(std::string(name) + ": " + std::to_string(g_testFailures.load()) + " failure(s)");
+	else
+		LogError(std::string(name) + ": OK");
+	std::cerr.flush();
+	_exit(g_testFailures ? 1 : 0);
+}
+
+#endif
@@ -0,0 +1,84 @@
+// SecureRandom: the ChaCha20 block function against RFC 8439, and the
+// session keys drawn from it.
+#include "test.h"
+#include "csprng.h"
+#include "session.h"
+#include <set>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+static std::string Hex(unsigned char const* data, std::size_t size)
+{
+	static char const digits[] = "0123456789abcdef";
+	std::string out;
+	for(std::size_t i = 0; i < size; ++i)
+	{
+		out += digits[data[i] >> 4];
+		out += digits[data[i] & 0xF];
+	}
+	return out;
+}
+
+// RFC 8439 2.3.2, and A.1 test vector #1.
+static void TestBlock()
+{
+	std::uint32_t key[8];
+	for(int i = 0; i < 8; ++i)
+	{
+		key[i] = static_cast<std::uint32_t>(4 * i) | static_cast<std::uint32_t>(4 * i + 1) << 8
+			| static_cast<std::uint32_t>(4 * i + 2) << 16 | static_cast<std::uint32_t>(4 * i + 3) << 24;
+	}
+	std::uint32_t const input[4] = { 1, 0x09000000, 0x4a000000, 0 };
+	unsigned char out[64];
+	SecureRandom::Block(key, input, out);
+	CHECK(Hex(out, 64) ==
+		"10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+		"d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e");
+
+	std::uint32_t const zeroKey[8] = { 0 };
+	std::uint32_t const zeroInput[4] = { 0 };
+	SecureRandom::Block(zeroKey, zeroInput, out);
+	CHECK(Hex(out, 64) ==
+		"76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7"
+		"da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586");
+}
+
+// Every character is reachable, nothing outside the set comes out, and
+// keys don't repeat.
+static void TestSessionKeys()
+{
+	static char const characters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+	std::set<std::string> keys;
+	std::set<char> seen;
+	for(int i = 0; i < 1000; ++i)
+	{
+		std::string key;
+		SessionManager::CreateSessionKey(key);
+		CHECK(key.size() == static_cast<std::size_t>(g_settings->m_sessionKeyLen));
+		CHECK(key.find_first_not_of(characters) == std::string::npos);
+		seen.insert(key.begin(), key.end());
+		keys.insert(key);
+	}
+	CHECK(keys.size() == 1000);
+	CHECK(seen.size() == sizeof(characters) - 1);
+
+	unsigned counts[7] = { 0 };
+	for(int i = 0; i < 70000; ++i)
+	{
+		unsigned const v = SecureRandom::Below(7);
+		CHECK(v < 7);
+		if(v < 7)
+			++counts[v];
+	}
+	for(int i = 0; i < 7; ++i)
+		CHECK(counts[i] > 9000 && counts[i] < 11000);
+}
+
+int main()
+{
+	PublishTestSettings();
+	TestBlock();
+	TestSessionKeys();
+	return TestResult("test_csprng");
+}
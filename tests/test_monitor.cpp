@@ -0,0 +1,148 @@
+// FileMonitor fingerprints: equal contents agree, any change shows, and a
+// file shrinking while it is being hashed doesn't bring the process down.
+// Cached missing scripts take no inotify watches.
+#include "test.h"
+#include "monitor.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void WriteFile(std::string const& path, std::string const& data)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out << data;
+}
+
+static void UseFingerprint(FingerprintMode mode)
+{
+	PublishTestSettings([mode](Settings& s) { s.m_fingerprint = mode; });
+}
+
+// Watches held by the process' inotify descriptors, from /proc.
+static int InotifyWatches()
+{
+	int watches = 0;
+	DIR* fds = opendir("/proc/self/fd");
+	if(!fds)
+		return -1;
+	while(dirent* entry = readdir(fds))
+	{
+		char target[64] = { 0 };
+		std::string const fd = entry->d_name;
+		if(readlink(("/proc/self/fd/" + fd).c_str(), target, sizeof(target) - 1) < 0
+			|| std::strcmp(target, "anon_inode:inotify") != 0)
+			continue;
+		std::ifstream info("/proc/self/fdinfo/" + fd);
+		std::string line;
+		while(std::getline(info, line))
+			watches += line.compare(0, 11, "inotify wd:") == 0;
+	}
+	closedir(fds);
+	return watches;
+}
+
+// Requests for missing scripts can name any directory: caching their 404
+// must not cost a watch each.
+static void TestMissingNotWatched(std::string const& dir)
+{
+	PublishTestSettings([](Settings& s) {
+		s.m_useInotify = true;
+		s.m_missingCacheSize = 1024;
+		s.m_missingCacheTime = 60000;
+	});
+	FileWatcher::Start();
+	int const before = InotifyWatches();
+	CHECK(before >= 0);
+	
+	std::vector<std::string> dirs;
+	for(int i = 0; i < 20; ++i)
+	{
+		dirs.push_back(dir + "/d" + std::to_string(i));
+		mkdir(dirs.back().c_str(), 0700);
+	}
+	for(int i = 0; i < 200; ++i)
+	{
+		SimplifiedPath const path = FileMonitor::simplify(dirs[i % dirs.size()] + "/missing" + std::to_string(i) + ".lua", dir);
+		MissingFiles::Add(path);
+		CHECK(MissingFiles::Contains(path));
+	}
+	CHECK(InotifyWatches() == before);
+	
+	// Watching a script's directory still shows up.
+	std::shared_ptr<FileWatch> watch = FileWatcher::Watch(dirs[0] + "/script.lua", dirs[0]);
+	CHECK(watch);
+	CHECK(InotifyWatches() == before + 1);
+	watch.reset();
+	for(std::size_t i = 0; i < dirs.size(); ++i)
+		rmdir(dirs[i].c_str());
+}
+
+int main()
+{
+	std::string const dir = TestDirectory();
+	std::string const a = dir + "/a.lua";
+	std::string const b = dir + "/b.lua";
+	
+	// Larger than the read buffer, and not a multiple of a stripe.
+	std::string data;
+	for(int i = 0; data.size() < 100000; ++i)
+		data += "print(" + std::to_string(i) + ")\n";
+	
+	FingerprintMode const modes[] = { FP_HASH, FP_SHA256 };
+	for(int m = 0; m < 2; ++m)
+	{
+		UseFingerprint(modes[m]);
+		WriteFile(a, data);
+		WriteFile(b, data);
+		FileChangeData fa = FileMonitor::getFileStatus(a);
+		FileChangeData fb = FileMonitor::getFileStatus(b);
+		CHECK(fa.m_exists);
+		CHECK(fa.m_filesize == data.size());
+		CHECK(fa == fb);
+		
+		std::string changed = data;
+		changed[changed.size() / 2] ^= 1;
+		WriteFile(b, changed);
+		CHECK(FileMonitor::getFileStatus(b) != fa);
+		
+		WriteFile(b, data.substr(0, data.size() - 1));
+		CHECK(FileMonitor::getFileStatus(b) != fa);
+		
+		WriteFile(b, std::string());
+		FileChangeData empty = FileMonitor::getFileStatus(b);
+		CHECK(empty.m_exists && empty.m_filesize == 0);
+		CHECK(empty != fa);
+	}
+	
+	UseFingerprint(FP_STAT);
+	CHECK(!FileMonitor::getFileStatus(dir + "/missing.lua").m_exists);
+	CHECK(!FileMonitor::getFileStatus(dir).m_exists);
+	
+	// A deploy copying over a script while the scanner hashes it.
+	UseFingerprint(FP_HASH);
+	std::atomic<bool> stop(false);
+	std::thread writer([&]() {
+		for(int i = 0; !stop.load(); ++i)
+			WriteFile(a, (i & 1) ? data : data.substr(0, 10));
+	});
+	for(int i = 0; i < 2000; ++i)
+	{
+		FileChangeData fcd = FileMonitor::getFileStatus(a);
+		CHECK(!fcd.m_exists || fcd.m_filesize <= data.size());
+	}
+	stop = true;
+	writer.join();
+	
+	std::remove(a.c_str());
+	std::remove(b.c_str());
+	TestMissingNotWatched(dir);
+	rmdir(dir.c_str());
+	return TestResult("test_monitor");
+}
@@ -0,0 +1,719 @@
+// SessionManager and Session, driven natively: what they hold is read back
+// through the SessionStore records Collect writes.
+#include "test.h"
+#include "session.h"
+#include "lua_fnc.h"
+#include "reservoir.h"
+#include <atomic>
+#include <thread>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+static char const g_address[] = "192.0.2.1";
+static char const g_useragent[] = "TestBrowser/1.0";
+
+static SessionDetectData Browser(std::string const& key = std::string())
+{
+	SessionDetectData sdd;
+	sdd.m_sessionKey = key;
+	sdd.m_address = g_address;
+	sdd.m_useragent = g_useragent;
+	return sdd;
+}
+
+// Values in the prelude's codec.
+static std::string EncodeInt(std::int32_t v)
+{
+	std::string out(1, '\x03');
+	for(int i = 0; i < 4; ++i)
+		out += static_cast<char>((static_cast<std::uint32_t>(v) >> (8 * i)) & 0xFF);
+	return out;
+}
+
+static std::int32_t DecodeInt(std::string const& value)
+{
+	if(value.size() != 5 || value[0] != '\x03')
+		return -1;
+	std::uint32_t v = 0;
+	for(int i = 4; i >= 1; --i)
+		v = (v << 8) | static_cast<unsigned char>(value[i]);
+	return static_cast<std::int32_t>(v);
+}
+
+#define BYTES(s) std::string(s, sizeof(s) - 1)
+
+// depth tables, each the value of the next one's "a".
+static std::string Nested(int depth)
+{
+	if(depth == 0)
+		return BYTES("\x02");
+	return BYTES("\x08\x06\x01" "a") + Nested(depth - 1) + BYTES("\x00");
+}
+
+// Runs code as a request's script, with the Session API on manager and
+// the browser sdd. cookie gets the Set-Cookie value, if any.
+static bool RunScript(SessionManager& manager, SessionDetectData const& sdd, char const* code,
+	std::string* cookie = nullptr)
+{
+	Lua::State state;
+	if(!StateReservoir::Acquire(state))
+		return false;
+	LuaThreadCache cache;
+	LuaRequestData lrd;
+	lrd.m_cache = &cache;
+	lrd.m_request = nullptr;
+	lrd.m_session.Init(manager, sdd);
+	SetupLuaFunctions(state, lrd);
+	bool const ok = state.loadbuffer(code, std::strlen(code), "test") == 0 && state.pcall() == 0;
+	if(!ok)
+		LogError(state.isstring(-1) ? state.tostdstring(-1) : std::string("Unknown error."));
+	else
+	{
+		lrd.m_session.Finish();
+		if(cookie)
+		{
+			cookie->clear();
+			lrd.m_session.getCookieString(*cookie, std::string());
+		}
+	}
+	state.close();
+	return ok;
+}
+
+// A parsed SessionStore record.
+struct Record {
+	char m_type;
+	std::string m_key;
+	std::int64_t m_expiration;
+	std::string m_address;
+	std::string m_useragent;
+	std::string m_languages;
+	std::map<std::string, std::map<std::string, std::string>> m_realms;
+};
+
+struct Reader {
+	char const* m_p;
+	char const* m_end;
+
+	bool u32(std::uint32_t& v)
+	{
+		if(m_end - m_p < 4)
+			return false;
+		v = 0;
+		for(int i = 3; i >= 0; --i)
+			v = (v << 8) | static_cast<unsigned char>(m_p[i]);
+		m_p += 4;
+		return true;
+	}
+	bool str(std::string& s)
+	{
+		std::uint32_t size;
+		if(!u32(size) || static_cast<std::size_t>(m_end - m_p) < size)
+			return false;
+		s.assign(m_p, size);
+		m_p += size;
+		return true;
+	}
+};
+
+static std::vector<Record> ParseLog(std::string const& log)
+{
+	std::vector<Record> records;
+	Reader in{log.data(), log.data() + log.size()};
+	while(in.m_p != in.m_end)
+	{
+		Record r;
+		r.m_type = *in.m_p++;
+		std::uint32_t length;
+		bool ok = in.u32(length) && static_cast<std::size_t>(in.m_end - in.m_p) >= length;
+		CHECK(ok);
+		if(!ok)
+			break;
+		Reader rec{in.m_p, in.m_p + length};
+		in.m_p += length;
+		ok = rec.str(r.m_key);
+		if(ok && r.m_type == 'S')
+		{
+			std::uint32_t lo = 0, hi = 0, realms = 0;
+			ok = rec.u32(lo) && rec.u32(hi)
+				&& rec.str(r.m_address) && rec.str(r.m_useragent) && rec.str(r.m_languages)
+				&& rec.u32(realms);
+			r.m_expiration = static_cast<std::int64_t>((static_cast<std::uint64_t>(hi) << 32) | lo);
+			for(std::uint32_t i = 0; ok && i < realms; ++i)
+			{
+				std::string realm;
+				std::uint32_t vars = 0;
+				ok = rec.str(realm) && rec.u32(vars);
+				std::map<std::string, std::string>& values = r.m_realms[realm];
+				for(std::uint32_t v = 0; ok && v < vars; ++v)
+				{
+					std::string var;
+					ok = rec.str(var) && rec.str(values[var]);
+				}
+			}
+		}
+		CHECK(ok && (r.m_type == 'S' || r.m_type == 'D') && rec.m_p == rec.m_end);
+		records.push_back(r);
+	}
+	return records;
+}
+
+static void PutU32(std::string& out, std::uint32_t v)
+{
+	for(int i = 0; i < 4; ++i)
+		out += static_cast<char>((v >> (8 * i)) & 0xFF);
+}
+
+static void PutString(std::string& out, std::string const& s)
+{
+	PutU32(out, static_cast<std::uint32_t>(s.size()));
+	out += s;
+}
+
+static std::string WriteRecord(Record const& r)
+{
+	std::string payload;
+	PutString(payload, r.m_key);
+	PutU32(payload, static_cast<std::uint32_t>(static_cast<std::uint64_t>(r.m_expiration)));
+	PutU32(payload, static_cast<std::uint32_t>(static_cast<std::uint64_t>(r.m_expiration) >> 32));
+	PutString(payload, r.m_address);
+	PutString(payload, r.m_useragent);
+	PutString(payload, r.m_languages);
+	PutU32(payload, static_cast<std::uint32_t>(r.m_realms.size()));
+	for(auto itr = r.m_realms.begin(); itr != r.m_realms.end(); ++itr)
+	{
+		PutString(payload, itr->first);
+		PutU32(payload, static_cast<std::uint32_t>(itr->second.size()));
+		for(auto itv = itr->second.begin(); itv != itr->second.end(); ++itv)
+		{
+			PutString(payload, itv->first);
+			PutString(payload, itv->second);
+		}
+	}
+	std::string out(1, 'S');
+	PutU32(out, static_cast<std::uint32_t>(payload.size()));
+	return out + payload;
+}
+
+// Every live session, by key.
+static std::map<std::string, Record> Snapshot(SessionManager& manager)
+{
+	std::string log;
+	manager.Collect(log, true);
+	std::vector<Record> records = ParseLog(log);
+	std::map<std::string, Record> sessions;
+	for(auto it = records.begin(); it != records.end(); ++it)
+		sessions[it->m_key] = *it;
+	return sessions;
+}
+
+static bool SameSessions(std::map<std::string, Record> const& a, std::map<std::string, Record> const& b)
+{
+	if(a.size() != b.size())
+		return false;
+	for(auto ita = a.begin(), itb = b.begin(); ita != a.end(); ++ita, ++itb)
+	{
+		if(ita->first != itb->first || ita->second.m_expiration != itb->second.m_expiration
+			|| ita->second.m_address != itb->second.m_address
+			|| ita->second.m_useragent != itb->second.m_useragent
+			|| ita->second.m_realms != itb->second.m_realms)
+			return false;
+	}
+	return true;
+}
+
+// Keys of the live sessions, by their "n" variable.
+static std::map<int, std::string> KeysByNumber(SessionManager& manager)
+{
+	std::map<std::string, Record> const sessions = Snapshot(manager);
+	std::map<int, std::string> keys;
+	for(auto it = sessions.begin(); it != sessions.end(); ++it)
+	{
+		auto realm = it->second.m_realms.find("r");
+		if(realm != it->second.m_realms.end() && realm->second.count("n"))
+			keys[DecodeInt(realm->second.at("n"))] = it->first;
+	}
+	return keys;
+}
+
+// The open-addressing table through its growth, and backward shift
+// deletion: whatever is erased, every other session stays reachable.
+static void TestShardTable()
+{
+	SessionManager manager;
+	manager.Setup(1, false);
+	enum { SESSIONS = 3000 };
+	for(int i = 0; i < SESSIONS; ++i)
+	{
+		std::string const n = EncodeInt(i);
+		manager.CreateSession(Browser())->SetVar("r", "n", &n);
+	}
+	std::map<int, std::string> const keys = KeysByNumber(manager);
+	CHECK(keys.size() == SESSIONS);
+
+	// Identity checks still apply.
+	SessionDetectData stranger = Browser(keys.begin()->second);
+	stranger.m_address = "198.51.100.7";
+	stranger.m_useragent = "Other/2.0";
+	CHECK(manager.findSession(stranger) == nullptr);
+	CHECK(manager.findSession(Browser("no such key")) == nullptr);
+
+	// Two thirds deleted in a scattered order.
+	std::vector<bool> deleted(SESSIONS, false);
+	unsigned seed = 12345;
+	int removed = 0;
+	while(removed < SESSIONS * 2 / 3)
+	{
+		int const i = static_cast<int>(rand_r(&seed) % SESSIONS);
+		if(deleted[i])
+			continue;
+		Session* session = manager.findSession(Browser(keys.at(i)));
+		CHECK(session != nullptr);
+		manager.DeleteSession(session);
+		deleted[i] = true;
+		if(++removed % 250 == 0)
+		{
+			for(int j = 0; j < SESSIONS; ++j)
+				CHECK((manager.findSession(Browser(keys.at(j))) == nullptr) == deleted[j]);
+		}
+	}
+	// The freed slots are reused.
+	for(int i = SESSIONS; i < SESSIONS + 1000; ++i)
+	{
+		std::string const n = EncodeInt(i);
+		manager.CreateSession(Browser())->SetVar("r", "n", &n);
+	}
+	std::map<int, std::string> const after = KeysByNumber(manager);
+	CHECK(after.size() == static_cast<std::size_t>(SESSIONS - removed + 1000));
+	for(auto it = after.begin(); it != after.end(); ++it)
+	{
+		CHECK(manager.findSession(Browser(it->second)) != nullptr);
+		CHECK(it->first >= SESSIONS || !deleted[it->first]);
+	}
+}
+
+// The timer wheel removes sessions once they expired, not before, and
+// files the ones touched since for later.
+static void TestExpiry()
+{
+	PublishTestSettings([](Settings& s) { s.m_sessionTime = 2; });
+	SessionManager manager;
+	manager.Setup(2, false);
+	enum { SESSIONS = 300 }; // More than ExpireSessions handles per lock
+	for(int i = 0; i < SESSIONS; ++i)
+	{
+		std::string const n = EncodeInt(i);
+		manager.CreateSession(Browser())->SetVar("r", "n", &n);
+	}
+	std::map<int, std::string> const keys = KeysByNumber(manager);
+	CHECK(keys.size() == SESSIONS);
+	auto live = [&]() {
+		int count = 0;
+		for(auto it = keys.begin(); it != keys.end(); ++it)
+			count += manager.findSession(Browser(it->second)) != nullptr;
+		return count;
+	};
+	// Its timer outlives it.
+	manager.DeleteSession(manager.findSession(Browser(keys.at(1))));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	manager.ExpireSessions();
+	CHECK(live() == SESSIONS - 1);
+
+	// Extended by a second and a half.
+	std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+	manager.findSession(Browser(keys.at(0)))->Start();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(1600));
+	manager.ExpireSessions();
+	CHECK(live() == 1);
+	CHECK(manager.findSession(Browser(keys.at(0))) != nullptr);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+	manager.ExpireSessions();
+	CHECK(live() == 0);
+	PublishTestSettings([](Settings& s) { s.m_sessionTime = 100; });
+}
+
+// SetVar takes exactly the values the prelude's codec writes, and keeps
+// their bytes, inline or in the arena, through overwrites and compaction.
+static void TestCodec()
+{
+	SessionManager manager;
+	manager.Setup(1, false);
+	Session* session = manager.CreateSession(Browser());
+
+	std::string const valid[] = {
+		BYTES("\x01"),
+		BYTES("\x02"),
+		BYTES("\x03\x00\x00\x00\x80"),
+		BYTES("\x04\x01\x02\x03\x04\x05\x06\x07\x08"),
+		BYTES("\x05\x00\x00\x00\x00\x00\x00\xf8\x3f"),
+		BYTES("\x06\x00"),
+		BYTES("\x06\x03" "abc"),
+		BYTES("\x07\x2c\x01\x00\x00") + std::string(300, 'l'),
+		BYTES("\x08\x00"),
+		BYTES("\x08\x06\x01" "a" "\x02" "\x03\x01\x00\x00\x00" "\x08\x00" "\x00"),
+		Nested(32)
+	};
+	std::string const invalid[] = {
+		std::string(),
+		BYTES("\x00"),
+		BYTES("\x09"),
+		BYTES("\x03\x01\x00"),
+		BYTES("\x04\x01"),
+		BYTES("\x05"),
+		BYTES("\x06"),
+		BYTES("\x06\x05" "abc"),
+		BYTES("\x07\x01\x00"),
+		BYTES("\x07\x05\x00\x00\x00" "ab"),
+		BYTES("\x08"),
+		BYTES("\x08\x02"),
+		BYTES("\x08\x02\x02"),
+		BYTES("\x08\x09\x02\x00"),
+		BYTES("\x01\x01"),
+		Nested(33)
+	};
+	std::size_t const validCount = sizeof(valid) / sizeof(valid[0]);
+	for(std::size_t i = 0; i < validCount; ++i)
+		CHECK(session->SetVar("valid", std::to_string(i), &valid[i]));
+	for(std::size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+	{
+		CHECK(!session->SetVar("invalid", std::to_string(i), &invalid[i]));
+		CHECK(!session->SetVar("valid", "0", &invalid[i]));
+	}
+
+	Record record = Snapshot(manager).begin()->second;
+	CHECK(record.m_realms.count("invalid") == 0);
+	CHECK(record.m_realms["valid"].size() == validCount);
+	for(std::size_t i = 0; i < validCount; ++i)
+		CHECK(record.m_realms["valid"][std::to_string(i)] == valid[i]);
+
+	// Arena values rewritten until most of the arena is garbage.
+	std::map<std::string, std::string> expected;
+	for(int round = 0; round < 100; ++round)
+	{
+		for(int v = 0; v < 10; ++v)
+		{
+			std::string const name = "v" + std::to_string(v);
+			std::string const value = BYTES("\x07\x2c\x01\x00\x00")
+				+ std::string(300, static_cast<char>('a' + (round + v) % 26));
+			CHECK(session->SetVar("arena", name, &value));
+			expected[name] = value;
+		}
+		std::string const small = EncodeInt(round);
+		CHECK(session->SetVar("arena", "small", &small));
+		expected["small"] = small;
+	}
+	CHECK(session->SetVar("arena", "v9", nullptr));
+	expected.erase("v9");
+	record = Snapshot(manager).begin()->second;
+	CHECK(record.m_realms["arena"] == expected);
+
+	// Clearing one realm keeps the arena values of the others.
+	session->Clear("valid");
+	record = Snapshot(manager).begin()->second;
+	CHECK(record.m_realms["valid"].empty());
+	CHECK(record.m_realms["arena"] == expected);
+	session->Clear("*");
+	CHECK(Snapshot(manager).begin()->second.m_realms.empty());
+}
+
+// The same codec, from Lua: every type comes back as it went in.
+static void TestCodecScript()
+{
+	SessionManager manager;
+	manager.Setup(1, false);
+	CHECK(RunScript(manager, Browser(), R"lua(
+		local t = { int = 7, low = -0x80000000, big = 0x123456789, float = 1.5, yes = true, no = false,
+			short = "abc", long = string.rep("x", 300), empty = "", list = { 1, 2, { deep = "z" } } }
+		assert(Session.SetVar("r", "t", t))
+		local u = Session.GetVar("r", "t")
+		assert(math.type(u.int) == "integer" and u.int == 7)
+		assert(math.type(u.low) == "integer" and u.low == -0x80000000)
+		assert(math.type(u.big) == "integer" and u.big == 0x123456789)
+		assert(math.type(u.float) == "float" and u.float == 1.5)
+		assert(u.yes == true and u.no == false)
+		assert(u.short == "abc" and u.long == string.rep("x", 300) and u.empty == "")
+		assert(#u.list == 3 and u.list[2] == 2 and u.list[3].deep == "z")
+		assert(Session.SetVar("r", "n", 42) and Session.GetVar("r", "n") == 42)
+
+		local deep = true
+		for i = 1, 32 do deep = { deep } end
+		assert(Session.SetVar("r", "deep", deep))
+		assert(Session.SetVar("r", "deeper", { deep }) == false)
+		assert(Session.SetVar("r", "f", function() end) == false)
+		assert(Session.GetVar("r", "f") == nil)
+
+		Session.SetVar("r", "t", nil)
+		assert(Session.GetVar("r", "t") == nil)
+	)lua"));
+}
+
+// A request only looks its session up once the script uses the Session
+// API: until then nothing is read, refreshed or sent back.
+static void TestLazyLookup()
+{
+	SessionManager manager;
+	manager.Setup(1, false);
+	std::string const n = EncodeInt(1);
+	manager.CreateSession(Browser())->SetVar("r", "n", &n);
+	std::string const key = KeysByNumber(manager).at(1);
+
+	// The browser's languages changed since: findSession records them.
+	SessionDetectData sdd = Browser(key);
+	sdd.m_languages = "fr";
+	std::string cookie;
+	{
+		LuaSessionInterface session;
+		session.Init(manager, sdd);
+		CHECK(!session.getCookieString(cookie, std::string()));
+		CHECK(Snapshot(manager).at(key).m_languages.empty());
+	}
+	{
+		LuaSessionInterface session;
+		session.Init(manager, sdd);
+		CHECK(session.HasRealm("r"));
+		CHECK(Snapshot(manager).at(key).m_languages == "fr");
+		CHECK(session.getCookieString(cookie, std::string()));
+		CHECK(cookie.compare(0, key.size() + 13, "XLuaSession=" + key + ";") == 0);
+	}
+
+	// No cookie, and the script didn't start a session.
+	{
+		LuaSessionInterface session;
+		session.Init(manager, Browser());
+		CHECK(!session.HasRealm("r"));
+		CHECK(!session.getCookieString(cookie, std::string()));
+	}
+	// A stale cookie is deleted, once the script looked.
+	{
+		LuaSessionInterface session;
+		session.Init(manager, Browser("stale"));
+		CHECK(!session.getCookieString(cookie, std::string()));
+		CHECK(!session.HasRealm("r"));
+		CHECK(session.getCookieString(cookie, std::string()));
+		CHECK(cookie.find("XLuaSession=_;") == 0);
+	}
+	// Writing starts one.
+	{
+		LuaSessionInterface session;
+		session.Init(manager, Browser());
+		CHECK(session.SetVar("r", "n", &n));
+		CHECK(session.getCookieString(cookie, std::string()));
+		CHECK(Snapshot(manager).size() == 2);
+	}
+
+	std::string scriptCookie = "unset";
+	CHECK(RunScript(manager, Browser(key), "local x = 1", &scriptCookie));
+	CHECK(scriptCookie.empty());
+}
+
+// SetMany stores a table's string keys in one go; GetMany and GetRealm
+// give them back as tables.
+static void TestBatch()
+{
+	SessionManager manager;
+	manager.Setup(1, false);
+	Session* session = manager.CreateSession(Browser());
+	std::string const big = BYTES("\x07\x2c\x01\x00\x00") + std::string(300, 'b');
+	CHECK(session->SetVar("r", "a", &big));
+
+	std::string const values = BYTES("\x08" "\x06\x01" "a") + EncodeInt(1)
+		+ BYTES("\x06\x01" "b" "\x06\x01" "x")
+		+ EncodeInt(7) + BYTES("\x06\x04" "skip")
+		+ BYTES("\x06\x01" "c") + big
+		+ BYTES("\x00");
+	CHECK(session->SetMany("r", values));
+	CHECK(!session->SetMany("r", std::string()));
+	CHECK(!session->SetMany("r", EncodeInt(1)));
+	CHECK(!session->SetMany("r", BYTES("\x08\x06\x01" "d")));
+	CHECK(!session->SetMany("other", BYTES("\x08\x06\x01" "d" "\x02")));
+
+	Record const record = Snapshot(manager).begin()->second;
+	std::map<std::string, std::string> const expected = {
+		{ "a", EncodeInt(1) }, { "b", BYTES("\x06\x01" "x") }, { "c", big }
+	};
+	CHECK(record.m_realms.count("r") && record.m_realms.at("r") == expected);
+	CHECK(record.m_realms.count("other") == 0);
+
+	CHECK(RunScript(manager, Browser(), R"lua(
+		assert(next(Session.GetMany("r", { "a" })) == nil)
+		assert(next(Session.GetRealm("*")) == nil)
+		assert(Session.SetMany("r", { a = 1, b = "x", [1] = "skipped", t = { 1, 2 } }))
+		assert(Session.SetMany("s", { a = 2, c = true }))
+		assert(Session.SetMany("r", 5) == false)
+		assert(Session.SetMany("r", { f = print }) == false)
+
+		local m = Session.GetMany("r", { "a", "t", "missing" })
+		assert(m.a == 1 and m.t[2] == 2 and m.b == nil and m.missing == nil)
+		local r = Session.GetRealm("r")
+		assert(r.a == 1 and r.b == "x" and r[1] == nil and #r.t == 2)
+		local all = Session.GetRealm("*")
+		assert(all.b == "x" and all.c == true and (all.a == 1 or all.a == 2))
+		assert(next(Session.GetRealm("none")) == nil)
+	)lua"));
+}
+
+// A change made while Collect runs is in that record or in the next one,
+// never lost between them.
+static void TestCollectRace()
+{
+	SessionManager manager;
+	manager.Setup(1, true);
+	Session* session = manager.CreateSession(Browser());
+	std::string created;
+	manager.Collect(created, false);
+
+	enum { ROUNDS = 20000 };
+	std::atomic<int> go(0), done(0);
+	std::thread writer([&]() {
+		SettingsScope ss;
+		for(int round = 1; round <= ROUNDS; ++round)
+		{
+			while(go.load() != round)
+				std::this_thread::yield();
+			// A table long enough to take SetVar a while to check.
+			std::string value(1, '\x08');
+			for(int i = 0; i < 1000; ++i)
+				value += EncodeInt(i) + EncodeInt(round);
+			value += '\0';
+			session->SetVar("r", "n", &value);
+			done = round;
+		}
+	});
+
+	int last = 0, lost = 0;
+	auto collect = [&]() {
+		std::string log;
+		manager.Collect(log, false);
+		std::vector<Record> records = ParseLog(log);
+		for(auto it = records.begin(); it != records.end(); ++it)
+			last = DecodeInt(it->m_realms["r"]["n"].substr(6, 5));
+	};
+	for(int round = 1; round <= ROUNDS; ++round)
+	{
+		go = round;
+		while(done.load() != round)
+		{
+			collect();
+			std::this_thread::yield();
+		}
+		collect();
+		if(last != round)
+			++lost;
+	}
+	writer.join();
+	CHECK(lost == 0);
+}
+
+// Restore gives back what Collect wrote: the latest record of each session,
+// minus the deleted and the expired ones, up to a torn record.
+static void TestCollectRestore()
+{
+	SessionManager manager;
+	manager.Setup(4, true);
+	std::vector<Session*> sessions;
+	std::string const bigValue = std::string("\x07\x2c\x01\0\0", 5) + std::string(300, 'x');
+	for(int i = 0; i < 40; ++i)
+	{
+		Session* session = manager.CreateSession(Browser());
+		std::string const n = EncodeInt(i);
+		session->SetVar("r", "n", &n);
+		if(i % 3 == 0)
+			session->SetVar("other", "big", &bigValue);
+		sessions.push_back(session);
+	}
+
+	std::string log;
+	manager.Collect(log, false);
+	std::vector<Record> const first = ParseLog(log);
+	CHECK(first.size() == 40);
+	std::map<int, Record> byNumber;
+	for(auto it = first.begin(); it != first.end(); ++it)
+		byNumber[DecodeInt(it->m_realms.at("r").at("n"))] = *it;
+	CHECK(byNumber.size() == 40);
+
+	// Nothing changed, nothing logged.
+	std::string unchanged;
+	manager.Collect(unchanged, false);
+	CHECK(unchanged.empty());
+
+	for(int i = 0; i < 10; ++i)
+		manager.DeleteSession(sessions[i]);
+	std::string const n = EncodeInt(1000);
+	sessions[20]->SetVar("r", "n", &n);
+	sessions[21]->SetVar("r", "n", nullptr);
+	sessions[22]->Clear("*");
+	manager.Collect(log, false);
+
+	std::map<std::string, Record> expected = Snapshot(manager);
+	CHECK(expected.size() == 30);
+
+	// Session 30 expired since, session 31's next record torn.
+	Record expired = byNumber[30];
+	expired.m_expiration = 1;
+	log += WriteRecord(expired);
+	expected.erase(expired.m_key);
+	Record torn = byNumber[31];
+	torn.m_realms["r"]["n"] = EncodeInt(-5);
+	std::string const tornRecord = WriteRecord(torn);
+	log.append(tornRecord, 0, tornRecord.size() - 3);
+
+	SessionManager restored;
+	restored.Setup(2, true);
+	CHECK(restored.Restore(log.data(), log.size()) == 29);
+	std::map<std::string, Record> const actual = Snapshot(restored);
+	CHECK(SameSessions(expected, actual));
+	CHECK(actual.count(byNumber[5].m_key) == 0);
+	CHECK(actual.count(byNumber[30].m_key) == 0);
+	CHECK(DecodeInt(actual.at(byNumber[20].m_key).m_realms.at("r").at("n")) == 1000);
+	CHECK(actual.at(byNumber[21].m_key).m_realms.at("r").empty());
+	CHECK(actual.at(byNumber[22].m_key).m_realms.empty());
+	CHECK(DecodeInt(actual.at(byNumber[31].m_key).m_realms.at("r").at("n")) == 31);
+	CHECK(actual.at(byNumber[33].m_key).m_realms.at("other").at("big") == bigValue);
+	CHECK(restored.findSession(Browser(byNumber[25].m_key)) != nullptr);
+	CHECK(restored.findSession(Browser(byNumber[5].m_key)) == nullptr);
+}
+
+// A read that extends a session logs the new expiration, once.
+static void TestCollectExpiration()
+{
+	SessionManager manager;
+	manager.Setup(1, true);
+	Session* session = manager.CreateSession(Browser());
+	std::string log;
+	manager.Collect(log, false);
+	std::int64_t const first = ParseLog(log).at(0).m_expiration;
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	session->HasRealm("r");
+	log.clear();
+	manager.Collect(log, false);
+	std::vector<Record> records = ParseLog(log);
+	CHECK(records.size() == 1 && records[0].m_expiration > first);
+
+	log.clear();
+	manager.Collect(log, false);
+	CHECK(log.empty());
+}
+
+int main()
+{
+	PublishTestSettings([](Settings& s) { s.m_sessionTime = 100; });
+	TestShardTable();
+	TestExpiry();
+	TestCodec();
+	TestCodecScript();
+	TestLazyLookup();
+	TestBatch();
+	TestCollectRace();
+	TestCollectRestore();
+	TestCollectExpiration();
+	return TestResult("test_sessions");
+}
@@ -0,0 +1,83 @@
+// Settings snapshots: a SettingsScope keeps its settings through a reload,
+// and reading them from another thread without one is refused.
+#include "test.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main()
+{
+	PublishTestSettings([](Settings& s) { s.m_sessionTime = 100; });
+	int const generation = g_settings->m_configGeneration;
+	
+	// Pinned on another thread, then reloaded under it.
+	int before = 0, after = 0, pinnedGeneration = 0;
+	bool pinned = false, reloaded = false;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::thread reader([&]() {
+		SettingsScope ss;
+		before = g_settings->m_sessionTime;
+		pinnedGeneration = g_settings->m_configGeneration;
+		std::unique_lock<std::mutex> lk(mutex);
+		pinned = true;
+		cv.notify_one();
+		cv.wait(lk, [&]() { return reloaded; });
+		after = g_settings->m_sessionTime;
+	});
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		cv.wait(lk, [&]() { return pinned; });
+	}
+	PublishTestSettings([](Settings& s) { s.m_sessionTime = 200; });
+	{
+		std::lock_guard<std::mutex> lg(mutex);
+		reloaded = true;
+	}
+	cv.notify_one();
+	reader.join();
+	
+	CHECK(before == 100);
+	CHECK(after == 100);
+	CHECK(pinnedGeneration == generation);
+	CHECK(g_settings->m_sessionTime == 200);
+	CHECK(g_settings->m_configGeneration == generation + 1);
+	{
+		SettingsScope ss;
+		CHECK(g_settings->m_sessionTime == 200);
+	}
+	
+	// Unpinned, off the publishing thread: the process aborts.
+	pid_t child = fork();
+	if(child == 0)
+	{
+		std::thread([]() { std::printf("%d\n", g_settings->m_sessionTime); }).join();
+		_exit(0);
+	}
+	int status = 0;
+	CHECK(child > 0 && waitpid(child, &status, 0) == child);
+	CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+	
+	// A config that doesn't compile, or fails while running, is refused.
+	std::string const dir = TestDirectory();
+	char const* const broken[] = { "WorkerThreads = = 4\n", "LuaStates = 2\nerror(\"broken\")\n" };
+	for(char const* source : broken)
+	{
+		std::string const path = dir + "/config.lua";
+		std::ofstream(path) << source;
+		Settings settings;
+		CHECK(!settings.LoadSettings(path));
+		std::remove(path.c_str());
+	}
+	Settings missing;
+	CHECK(!missing.LoadSettings(dir + "/missing.lua"));
+	rmdir(dir.c_str());
+	
+	return TestResult("test_settings");
+}
@@ -0,0 +1,340 @@
+// SharedSessions: the shared memory table on its own, across processes,
+// after a process died holding a stripe, and under SessionMode "shared".
+#include "test.h"
+#include "shmstore.h"
+#include "session.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::string g_name;
+
+static std::int64_t Later()
+{
+	return static_cast<std::int64_t>(std::time(nullptr)) + 3600;
+}
+
+static std::string Payload(std::size_t size, char c)
+{
+	return std::string(size, c);
+}
+
+static void TestStore()
+{
+	std::string payload;
+	std::int64_t expiration = 0;
+	CHECK(!SharedSessions::Load("missing", payload, expiration));
+
+	std::int64_t const later = Later();
+	CHECK(SharedSessions::Store("empty", later, std::string()));
+	CHECK(SharedSessions::Store("small", later, Payload(10, 's')));
+	CHECK(SharedSessions::Store("large", later + 1, Payload(1000, 'l')));
+	CHECK(SharedSessions::Load("empty", payload, expiration) && payload.empty() && expiration == later);
+	CHECK(SharedSessions::Load("small", payload, expiration) && payload == Payload(10, 's'));
+	CHECK(SharedSessions::Load("large", payload, expiration) && payload == Payload(1000, 'l') && expiration == later + 1);
+
+	// Replaced in place, bigger and smaller: the old blocks are reused,
+	// or a 4 KB stripe heap would run out after a couple of rounds.
+	for(int i = 0; i < 1000; ++i)
+	{
+		std::string const value = Payload(i % 2 ? 2000 : 100, static_cast<char>('a' + i % 26));
+		CHECK(SharedSessions::Store("small", later, value));
+		CHECK(SharedSessions::Load("small", payload, expiration) && payload == value);
+	}
+
+	SharedSessions::Remove("small");
+	CHECK(!SharedSessions::Load("small", payload, expiration));
+	CHECK(SharedSessions::Load("large", payload, expiration));
+	SharedSessions::Remove("small");
+
+	// Too large for a stripe, or for a slot's key.
+	CHECK(!SharedSessions::Store("huge", later, Payload(8192, 'h')));
+	CHECK(!SharedSessions::Store(std::string(65, 'k'), later, Payload(10, 'k')));
+
+	// Expired ones aren't handed out.
+	CHECK(SharedSessions::Store("old", 1, Payload(10, 'o')));
+	CHECK(!SharedSessions::Load("old", payload, expiration));
+	SharedSessions::Remove("empty");
+	SharedSessions::Remove("large");
+}
+
+// Once emptied, a stripe's heap takes blocks of any class again, and a
+// larger freed block is split for smaller ones.
+static void TestReuse()
+{
+	std::int64_t const later = Later();
+	for(int i = 0; i < 640; ++i)
+		SharedSessions::Store("small" + std::to_string(i), later, Payload(300, 's'));
+	for(int i = 0; i < 640; ++i)
+		SharedSessions::Remove("small" + std::to_string(i));
+	for(int i = 0; i < 200; ++i)
+	{
+		std::string const key = "whole" + std::to_string(i);
+		CHECK(SharedSessions::Store(key, later, Payload(4096, 'w')));
+		SharedSessions::Remove(key);
+	}
+	
+	// The keys of one stripe: the ones refused while a session fills its heap.
+	CHECK(SharedSessions::Store("anchor", later, Payload(4096, 'a')));
+	std::vector<std::string> same;
+	for(int i = 0; same.size() < 9 && i < 100000; ++i)
+	{
+		std::string const key = "probe" + std::to_string(i);
+		if(SharedSessions::Store(key, later, Payload(10, 'p')))
+			SharedSessions::Remove(key);
+		else
+			same.push_back(key);
+	}
+	SharedSessions::Remove("anchor");
+	CHECK(same.size() == 9);
+	if(same.size() < 9)
+		return;
+	
+	CHECK(SharedSessions::Store(same[0], later, Payload(2048, 'x')));
+	CHECK(SharedSessions::Store(same[1], later, Payload(2048, 'y')));
+	SharedSessions::Remove(same[0]);
+	for(std::size_t i = 2; i < same.size(); ++i)
+		CHECK(SharedSessions::Store(same[i], later, Payload(200, static_cast<char>('a' + i))));
+	std::string payload;
+	std::int64_t expiration;
+	CHECK(SharedSessions::Load(same[1], payload, expiration) && payload == Payload(2048, 'y'));
+	for(std::size_t i = 2; i < same.size(); ++i)
+		CHECK(SharedSessions::Load(same[i], payload, expiration) && payload == Payload(200, static_cast<char>('a' + i)));
+	for(std::size_t i = 1; i < same.size(); ++i)
+		SharedSessions::Remove(same[i]);
+}
+
+// Stripes filled with expired sessions refuse new ones until Expire went
+// around every stripe.
+static void TestExpire()
+{
+	std::vector<std::string> refused;
+	for(int i = 0; i < 2000; ++i)
+	{
+		std::string const key = "expired" + std::to_string(i);
+		if(!SharedSessions::Store(key, 1, Payload(10, 'e')))
+			refused.push_back(key);
+	}
+	CHECK(!refused.empty());
+	if(refused.empty())
+		return;
+	CHECK(!SharedSessions::Store(refused[0], Later(), Payload(10, 'n')));
+
+	for(int i = 0; i < 16; ++i) // 4 stripes a call
+		SharedSessions::Expire();
+	CHECK(SharedSessions::Store(refused[0], Later(), Payload(10, 'n')));
+	std::string payload;
+	std::int64_t expiration;
+	CHECK(SharedSessions::Load(refused[0], payload, expiration) && payload == Payload(10, 'n'));
+	SharedSessions::Remove(refused[0]);
+}
+
+static int Wait(pid_t pid)
+{
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return status;
+}
+
+// Another process maps the same segment and sees the same sessions.
+static void TestProcesses()
+{
+	CHECK(SharedSessions::Store("parent", Later(), Payload(100, 'p')));
+	pid_t const pid = fork();
+	if(pid == 0)
+	{
+		std::string payload;
+		std::int64_t expiration;
+		bool const ok = SharedSessions::Open(g_name, 256, 1024)
+			&& SharedSessions::Load("parent", payload, expiration) && payload == Payload(100, 'p')
+			&& SharedSessions::Store("child", Later(), Payload(200, 'c'));
+		_exit(ok ? 0 : 1);
+	}
+	int const status = Wait(pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	std::string payload;
+	std::int64_t expiration;
+	CHECK(SharedSessions::Load("child", payload, expiration) && payload == Payload(200, 'c'));
+	SharedSessions::Remove("child");
+	SharedSessions::Remove("parent");
+}
+
+// A process killed in the middle of its updates: whatever stripe it held
+// is recovered, and every stripe keeps working.
+static void TestKilledWriter()
+{
+	for(int round = 0; round < 5; ++round)
+	{
+		pid_t const pid = fork();
+		if(pid == 0)
+		{
+			for(unsigned i = 0;; ++i)
+			{
+				std::string const key = "dying" + std::to_string(i % 1000);
+				SharedSessions::Store(key, Later(), Payload(100 + i % 900, 'd'));
+				SharedSessions::Remove(key);
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(20 + 10 * round));
+		kill(pid, SIGKILL);
+		int const status = Wait(pid);
+		CHECK(WIFSIGNALED(status));
+	}
+
+	// Enough keys to cover every stripe.
+	for(int i = 0; i < 300; ++i)
+	{
+		std::string const key = "alive" + std::to_string(i);
+		std::string payload;
+		std::int64_t expiration;
+		CHECK(SharedSessions::Store(key, Later(), Payload(50, 'a')));
+		CHECK(SharedSessions::Load(key, payload, expiration) && payload == Payload(50, 'a'));
+		SharedSessions::Remove(key);
+	}
+}
+
+static std::string CookieValue(std::string const& header)
+{
+	std::string::size_type const eq = header.find('=');
+	std::string::size_type const end = header.find(';');
+	if(eq == std::string::npos || end == std::string::npos)
+		return std::string();
+	return header.substr(eq + 1, end - eq - 1);
+}
+
+// SessionMode "shared": a session written by one process is read by
+// another, and deleted for both.
+static void TestSharedSessions()
+{
+	PublishTestSettings([](Settings& s) { s.m_sessionMode = SM_SHARED; });
+	SessionManager manager;
+	SessionDetectData browser;
+	browser.m_address = "192.0.2.1";
+	browser.m_useragent = "TestBrowser/1.0";
+
+	std::string header;
+	{
+		LuaSessionInterface session;
+		session.Init(manager, browser);
+		std::string const value("\x02", 1);
+		CHECK(session.SetVar("r", "n", &value));
+		session.Finish();
+		CHECK(session.getCookieString(header, std::string()));
+	}
+	SessionDetectData back = browser;
+	back.m_sessionKey = CookieValue(header);
+	CHECK(back.m_sessionKey.size() == static_cast<std::size_t>(g_settings->m_sessionKeyLen));
+
+	pid_t const pid = fork();
+	if(pid == 0)
+	{
+		LuaSessionInterface session;
+		session.Init(manager, back);
+		_exit(session.HasRealm("r") ? 0 : 1);
+	}
+	int const status = Wait(pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	SessionDetectData elsewhere = back;
+	elsewhere.m_address = "198.51.100.7";
+	elsewhere.m_useragent = "Other/2.0";
+	{
+		LuaSessionInterface session;
+		session.Init(manager, elsewhere);
+		CHECK(!session.HasRealm("r"));
+	}
+	{
+		LuaSessionInterface session;
+		session.Init(manager, back);
+		session.Delete();
+		session.Finish();
+	}
+	{
+		LuaSessionInterface session;
+		session.Init(manager, back);
+		CHECK(!session.HasRealm("r"));
+	}
+	// Nothing is kept in this process.
+	std::string log;
+	manager.Collect(log, true);
+	CHECK(log.empty());
+}
+
+// A stripe whose mutex was left inconsistent can't be locked any more: its
+// sessions are refused, without touching it, and the others keep working.
+// The first stripe's mutex sits right after the 64 byte aligned header.
+static void TestUnrecoverable()
+{
+	int const fd = shm_open(g_name.c_str(), O_RDWR, 0600);
+	CHECK(fd >= 0);
+	if(fd < 0)
+		return;
+	void* const p = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	CHECK(p != MAP_FAILED);
+	if(p == MAP_FAILED)
+		return;
+	pthread_mutex_t* const mutex = reinterpret_cast<pthread_mutex_t*>(static_cast<char*>(p) + 64);
+	pid_t const pid = fork();
+	if(pid == 0)
+	{
+		pthread_mutex_lock(mutex);
+		_exit(0);
+	}
+	Wait(pid);
+	CHECK(pthread_mutex_lock(mutex) == EOWNERDEAD);
+	pthread_mutex_unlock(mutex); // Without pthread_mutex_consistent
+	CHECK(pthread_mutex_lock(mutex) == ENOTRECOVERABLE);
+	munmap(p, 4096);
+	
+	int stored = 0, refused = 0;
+	for(int i = 0; i < 300; ++i)
+	{
+		std::string const key = "stuck" + std::to_string(i);
+		std::string payload;
+		std::int64_t expiration;
+		if(SharedSessions::Store(key, Later(), Payload(50, 's')))
+		{
+			++stored;
+			CHECK(SharedSessions::Load(key, payload, expiration));
+		}
+		else
+		{
+			++refused;
+			CHECK(!SharedSessions::Load(key, payload, expiration));
+		}
+		SharedSessions::Remove(key);
+	}
+	SharedSessions::Expire();
+	CHECK(stored > 0 && refused > 0);
+}
+
+int main()
+{
+	PublishTestSettings();
+	g_name = "/luafcgid2-test-" + std::to_string(getpid());
+	shm_unlink(g_name.c_str());
+	// 64 stripes of 16 slots and a 4 KB heap.
+	CHECK(SharedSessions::Open(g_name, 256, 1024));
+	PublishTestSettings([](Settings& s) { s.m_sessionKeyLen = 65; });
+	CHECK(!SharedSessions::Open(g_name, 256, 1024));
+	PublishTestSettings();
+	TestStore();
+	TestReuse();
+	TestExpire();
+	TestProcesses();
+	TestKilledWriter();
+	TestSharedSessions();
+	TestUnrecoverable();
+	shm_unlink(g_name.c_str());
+	return TestResult("test_shmstore");
+}
@@ -0,0 +1,162 @@
+// SignedCookie against the RFC 4231 HMAC-SHA256 vectors, and the session
+// cookies of SessionMode "cookie" built on it.
+#include "test.h"
+#include "signedcookie.h"
+#include "session.h"
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+static void UseSecret(std::string const& secret, int targetScore = 3)
+{
+	PublishTestSettings([&secret, targetScore](Settings& s) {
+		s.m_sessionSecret = secret;
+		s.m_sessionMode = SM_COOKIE;
+		s.m_sessionTargetScore = targetScore;
+	});
+}
+
+// RFC 4231 test cases 1, 2 and 6 (a key longer than the block), and an
+// empty payload.
+static void TestVectors()
+{
+	struct {
+		std::string m_key;
+		std::string m_data;
+		char const* m_cookie;
+	} const vectors[] = {
+		{ std::string(20, '\x0b'), "Hi There",
+			"SGkgVGhlcmU.sDRMYdjbOFNcqK_OrwvxK4gdwgDJgz2nJuk3bC4yz_c" },
+		{ "Jefe", "what do ya want for nothing?",
+			"d2hhdCBkbyB5YSB3YW50IGZvciBub3RoaW5nPw.W9zBRr9gdU5qBCQmCJV1x1oAPwidJzmDnexYuWTsOEM" },
+		{ std::string(131, '\xaa'), "Test Using Larger Than Block-Size Key - Hash Key First",
+			"VGVzdCBVc2luZyBMYXJnZXIgVGhhbiBCbG9jay1TaXplIEtleSAtIEhhc2ggS2V5IEZpcnN0"
+			".YOQxWR7gtn8Niiaqy_W3f44LxiE3KMUUBUYEDw7jf1Q" },
+		{ "s", "", ".ZOygfM5nkpw1fWPQpK7CB-d0gAQDKYkU_ATojOAqxJ8" }
+	};
+	for(std::size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i)
+	{
+		UseSecret(vectors[i].m_key);
+		CHECK(SignedCookie::Seal(vectors[i].m_data) == vectors[i].m_cookie);
+		std::string payload = "unset";
+		CHECK(SignedCookie::Open(vectors[i].m_cookie, payload));
+		CHECK(payload == vectors[i].m_data);
+	}
+}
+
+static void TestTampering()
+{
+	UseSecret("Jefe");
+	std::string const cookie = SignedCookie::Seal("what do ya want for nothing?");
+	std::string::size_type const dot = cookie.find('.');
+	std::string payload;
+
+	for(std::size_t i = 0; i < cookie.size(); i += 7)
+	{
+		if(i == dot)
+			continue;
+		std::string changed = cookie;
+		changed[i] = changed[i] == 'A' ? 'B' : 'A';
+		CHECK(!SignedCookie::Open(changed, payload));
+	}
+	CHECK(!SignedCookie::Open(cookie.substr(0, cookie.size() - 1), payload));
+	CHECK(!SignedCookie::Open(cookie.substr(0, dot), payload));
+	CHECK(!SignedCookie::Open(cookie + "A", payload));
+	CHECK(!SignedCookie::Open(cookie + "AA", payload));
+	CHECK(!SignedCookie::Open("!" + cookie, payload));
+	CHECK(!SignedCookie::Open(std::string(), payload));
+	CHECK(!SignedCookie::Open(".", payload));
+
+	UseSecret("jefe");
+	CHECK(!SignedCookie::Open(cookie, payload));
+
+	// Without a SessionSecret, this process' own.
+	UseSecret(std::string());
+	std::string const local = SignedCookie::Seal("what do ya want for nothing?");
+	CHECK(local != cookie);
+	CHECK(SignedCookie::Open(local, payload) && payload == "what do ya want for nothing?");
+	CHECK(!SignedCookie::Open(cookie, payload));
+}
+
+static std::string CookieValue(std::string const& header)
+{
+	std::string::size_type const eq = header.find('=');
+	std::string::size_type const end = header.find(';');
+	if(eq == std::string::npos || end == std::string::npos)
+		return std::string();
+	return header.substr(eq + 1, end - eq - 1);
+}
+
+// The whole session travels in the cookie, and comes back only unchanged,
+// unexpired and from the same browser.
+static void TestCookieSessions()
+{
+	UseSecret("Jefe");
+	SessionManager manager;
+	SessionDetectData browser;
+	browser.m_address = "192.0.2.1";
+	browser.m_useragent = "TestBrowser/1.0";
+
+	std::string header;
+	{
+		LuaSessionInterface session;
+		session.Init(manager, browser);
+		std::string const value("\x03\x05\0\0\0", 5);
+		CHECK(session.SetVar("r", "n", &value));
+		session.Finish();
+		CHECK(session.getCookieString(header, std::string()));
+	}
+	std::string const cookie = CookieValue(header);
+	CHECK(header.compare(0, 12, "XLuaSession=") == 0 && !cookie.empty());
+	std::string payload;
+	CHECK(SignedCookie::Open(cookie, payload) && !payload.empty() && payload[0] == '\x01');
+	CHECK(payload.find(std::string("\x01\0\0\0n\x05\0\0\0\x03\x05\0\0\0", 14)) != std::string::npos);
+
+	auto hasRealm = [&manager](SessionDetectData const& sdd) {
+		LuaSessionInterface session;
+		session.Init(manager, sdd);
+		return session.HasRealm("r");
+	};
+	SessionDetectData back = browser;
+	back.m_sessionKey = cookie;
+	CHECK(hasRealm(back));
+
+	SessionDetectData tampered = back;
+	tampered.m_sessionKey[3] = tampered.m_sessionKey[3] == 'A' ? 'B' : 'A';
+	CHECK(!hasRealm(tampered));
+
+	SessionDetectData elsewhere = back;
+	elsewhere.m_address = "198.51.100.7";
+	elsewhere.m_useragent = "Other/2.0";
+	CHECK(!hasRealm(elsewhere));
+
+	// Properly signed, identity not checked: only the expiration decides.
+	UseSecret("Jefe", 0);
+	auto sealed = [](std::int64_t expiration) {
+		std::string payload(1, '\x01');
+		for(int i = 0; i < 8; ++i)
+			payload += static_cast<char>((static_cast<std::uint64_t>(expiration) >> (8 * i)) & 0xFF);
+		payload += std::string(12, '\0'); // Identity hashes
+		payload += std::string("\x01\0\0\0" "\x01\0\0\0" "r" "\0\0\0\0", 13); // Realm "r", empty
+		return SignedCookie::Seal(payload);
+	};
+	SessionDetectData stale = elsewhere;
+	stale.m_sessionKey = sealed(1);
+	CHECK(!hasRealm(stale));
+	SessionDetectData fresh = elsewhere;
+	fresh.m_sessionKey = sealed(static_cast<std::int64_t>(std::time(nullptr)) + 3600);
+	CHECK(hasRealm(fresh));
+
+	// Nothing is kept on the server.
+	std::string log;
+	manager.Collect(log, true);
+	CHECK(log.empty());
+}
+
+int main()
+{
+	TestVectors();
+	TestTampering();
+	TestCookieSessions();
+	return TestResult("test_signedcookie");
+}
@@ -0,0 +1,171 @@
+// Stress test of the lock-free pool table: request threads run ExecMT while
+// the scripts keep changing (scanner rebuilds) and the budget keeps evicting
+// states and retiring the pools left empty, with Rcu::Reclaim freeing them.
+// Best built with OPTIMIZATION="-O1 -g -fsanitize=address".
+#include "test.h"
+#include "statepool.h"
+#include "rcu.h"
+#include <fcgiapp.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+// Just enough of libfcgi for ExecMT: streams are plain strings.
+struct FakeStream {
+	std::string m_data;
+};
+
+int FCGX_PutStr(const char* str, int n, FCGX_Stream* stream)
+{
+	reinterpret_cast<FakeStream*>(stream)->m_data.append(str, static_cast<std::size_t>(n));
+	return n;
+}
+
+int FCGX_GetStr(char*, int, FCGX_Stream*)
+{
+	return 0;
+}
+
+char* FCGX_GetParam(const char* name, FCGX_ParamArray envp)
+{
+	std::size_t const len = std::strlen(name);
+	for(; envp && *envp; ++envp)
+	{
+		if(std::strncmp(*envp, name, len) == 0 && (*envp)[len] == '=')
+			return *envp + len + 1;
+	}
+	return nullptr;
+}
+
+enum {
+	THREADS = 4,
+	SCRIPTS = 6,
+	SECONDS = 5
+};
+
+static std::string g_root;
+static std::atomic<int> g_versions[SCRIPTS];
+static std::atomic<bool> g_stop(false);
+static std::atomic<int> g_requests(0);
+
+static std::string ScriptPath(int script)
+{
+	return g_root + "/s" + std::to_string(script) + ".lua";
+}
+
+// Replaced in one rename, so that a request never reads half of it.
+static void WriteScript(int script, int version)
+{
+	std::string const path = ScriptPath(script);
+	{
+		std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+		out << "local v = " << version << "\nfunction main() Send(\"v\" .. v) end\n";
+	}
+	std::rename((path + ".tmp").c_str(), path.c_str());
+}
+
+static void RunRequests(int tid)
+{
+	LuaThreadCache cache;
+	unsigned seed = static_cast<unsigned>(tid) * 7919u + 1u;
+	while(!g_stop.load())
+	{
+		int const script = static_cast<int>(rand_r(&seed) % SCRIPTS);
+		std::string scriptFilename = "SCRIPT_FILENAME=" + ScriptPath(script);
+		std::string documentRoot = "DOCUMENT_ROOT=" + g_root;
+		char* envp[] = { &scriptFilename[0], &documentRoot[0], nullptr };
+
+		FakeStream out;
+		FCGX_Request request;
+		std::memset(&request, 0, sizeof(request));
+		request.out = reinterpret_cast<FCGX_Stream*>(&out);
+		request.envp = envp;
+
+		bool ok;
+		{
+			RcuSection rs(tid);
+			SettingsScope ss;
+			ok = g_statepool.ExecMT(tid, request, cache);
+		}
+		int const newest = g_versions[script].load();
+
+		CHECK(ok);
+		CHECK(out.m_data.compare(0, 14, "Status: 200 OK") == 0);
+		std::string::size_type body = out.m_data.find("\r\n\r\nv");
+		CHECK(body != std::string::npos);
+		if(body != std::string::npos)
+		{
+			int const version = std::atoi(out.m_data.c_str() + body + 5);
+			CHECK(version >= 1 && version <= newest);
+		}
+		++g_requests;
+	}
+}
+
+int main()
+{
+	g_root = TestDirectory();
+	PublishTestSettings([](Settings& s) {
+		s.m_states = 1;
+		s.m_maxstates = 2;
+		s.m_globalMaxStates = 3; // Fewer than the scripts: pools keep being retired
+		s.m_fileInfoTime = 10;
+		s.m_reservoirSize = 2;
+		s.m_fingerprint = FP_STAT;
+	});
+	for(int i = 0; i < SCRIPTS; ++i)
+	{
+		g_versions[i] = 1;
+		WriteScript(i, 1);
+	}
+
+	Rcu::Setup(THREADS + 1);
+	CHECK(g_statepool.Start(THREADS));
+
+	std::vector<std::thread> threads;
+	for(int i = 0; i < THREADS; ++i)
+		threads.emplace_back(RunRequests, i);
+
+	// The daemon's main loop, sped up, plus a script change every 20 ms.
+	auto const end = std::chrono::steady_clock::now() + std::chrono::seconds(SECONDS);
+	for(int tick = 0; std::chrono::steady_clock::now() < end; ++tick)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		if(tick % 4 == 0)
+		{
+			int const script = (tick / 4) % SCRIPTS;
+			// Published before the file, so that no request can be ahead of it.
+			int const version = ++g_versions[script];
+			WriteScript(script, version);
+		}
+		SettingsScope ss;
+		g_statepool.EnforceBudget();
+		Rcu::Reclaim();
+	}
+
+	g_stop = true;
+	for(auto it = threads.begin(); it != threads.end(); ++it)
+		it->join();
+
+	// Every state is idle now: the budget holds.
+	std::map<std::string, int> stats;
+	{
+		SettingsScope ss;
+		g_statepool.EnforceBudget();
+		stats = g_statepool.PoolStats();
+	}
+	CHECK(g_requests.load() > 0);
+	CHECK(stats["RebuiltPools"] > 0);
+	CHECK(stats["EvictedPools"] > 0);
+	CHECK(stats["LoadedStates"] <= 3);
+
+	for(int i = 0; i < SCRIPTS; ++i)
+		std::remove(ScriptPath(i).c_str());
+	rmdir(g_root.c_str());
+	return TestResult("test_statepool");
+}